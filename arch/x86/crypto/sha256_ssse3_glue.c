@@ -0,0 +1,280 @@
+/*
+ * Cryptographic API.
+ *
+ * Glue code for the SHA-256 Secure Hash Algorithm using the SSSE3
+ * instruction set.  Falls back to sha256-generic whenever the FPU may
+ * not be used.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+
+#include <crypto/internal/hash.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/cryptohash.h>
+#include <linux/types.h>
+#include <crypto/sha.h>
+#include <asm/byteorder.h>
+#include <asm/i387.h>
+#include <asm/cpufeature.h>
+
+asmlinkage void sha256_transform_ssse3(u32 *digest, const u8 *data,
+				       u64 blocks);
+asmlinkage void sha256_mb_transform_ssse3(u32 state[8][4], const u8 *data[4],
+					  u64 blocks);
+
+/* Messages hashed side by side by sha256_mb_transform_ssse3() */
+#define SHA256_MB_LANES		4
+
+static int sha256_ssse3_init(struct shash_desc *desc)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+
+	*sctx = (struct sha256_state){
+		.state = { SHA256_H0, SHA256_H1, SHA256_H2, SHA256_H3,
+			   SHA256_H4, SHA256_H5, SHA256_H6, SHA256_H7 },
+	};
+
+	return 0;
+}
+
+static void __sha256_ssse3_update(struct sha256_state *sctx, const u8 *data,
+				  unsigned int len, unsigned int partial)
+{
+	unsigned int done = 0;
+
+	sctx->count += len;
+
+	if (partial) {
+		done = SHA256_BLOCK_SIZE - partial;
+		memcpy(sctx->buf + partial, data, done);
+		sha256_transform_ssse3(sctx->state, sctx->buf, 1);
+	}
+
+	if (len - done >= SHA256_BLOCK_SIZE) {
+		const unsigned int rounds = (len - done) / SHA256_BLOCK_SIZE;
+
+		sha256_transform_ssse3(sctx->state, data + done, rounds);
+		done += rounds * SHA256_BLOCK_SIZE;
+	}
+
+	memcpy(sctx->buf, data + done, len - done);
+}
+
+static int sha256_ssse3_update(struct shash_desc *desc, const u8 *data,
+			       unsigned int len)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+	unsigned int partial = sctx->count % SHA256_BLOCK_SIZE;
+
+	/* Handle the fast case right here */
+	if (partial + len < SHA256_BLOCK_SIZE) {
+		sctx->count += len;
+		memcpy(sctx->buf + partial, data, len);
+
+		return 0;
+	}
+
+	if (!irq_fpu_usable())
+		return crypto_sha256_update(desc, data, len);
+
+	kernel_fpu_begin();
+	__sha256_ssse3_update(sctx, data, len, partial);
+	kernel_fpu_end();
+
+	return 0;
+}
+
+/* Add padding and return the message digest. */
+static int sha256_ssse3_final(struct shash_desc *desc, u8 *out)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+	unsigned int i, index, padlen;
+	__be32 *dst = (__be32 *)out;
+	__be64 bits;
+	static const u8 padding[SHA256_BLOCK_SIZE] = { 0x80, };
+
+	bits = cpu_to_be64(sctx->count << 3);
+
+	/* Pad out to 56 mod 64 and append length */
+	index = sctx->count % SHA256_BLOCK_SIZE;
+	padlen = (index < 56) ? (56 - index) :
+			       ((SHA256_BLOCK_SIZE + 56) - index);
+	if (!irq_fpu_usable()) {
+		crypto_sha256_update(desc, padding, padlen);
+		crypto_sha256_update(desc, (const u8 *)&bits, sizeof(bits));
+	} else {
+		kernel_fpu_begin();
+		/* We need to fill a whole block for __sha256_ssse3_update() */
+		if (padlen <= 56) {
+			sctx->count += padlen;
+			memcpy(sctx->buf + index, padding, padlen);
+		} else {
+			__sha256_ssse3_update(sctx, padding, padlen, index);
+		}
+		__sha256_ssse3_update(sctx, (const u8 *)&bits, sizeof(bits),
+				      56);
+		kernel_fpu_end();
+	}
+
+	/* Store state in digest */
+	for (i = 0; i < 8; i++)
+		dst[i] = cpu_to_be32(sctx->state[i]);
+
+	/* Wipe context */
+	memset(sctx, 0, sizeof(*sctx));
+
+	return 0;
+}
+
+/*
+ * Finishes up to SHA256_MB_LANES messages of @len bytes, each continuing
+ * from @sctx.  Unused lanes hash the first message again and are dropped.
+ */
+static void __sha256_ssse3_finup_mb(const struct sha256_state *sctx,
+				    const u8 * const data[], unsigned int len,
+				    u8 * const outs[], unsigned int num)
+{
+	u32 state[8][SHA256_MB_LANES] __aligned(16);
+	u8 tail[SHA256_MB_LANES][2 * SHA256_BLOCK_SIZE];
+	const u8 *ptrs[SHA256_MB_LANES];
+	const u8 *msg[SHA256_MB_LANES];
+	unsigned int partial = sctx->count % SHA256_BLOCK_SIZE;
+	unsigned int done = 0, blocks, rest, i, j;
+	__be64 bits = cpu_to_be64((sctx->count + len) << 3);
+
+	for (j = 0; j < SHA256_MB_LANES; j++) {
+		msg[j] = data[j < num ? j : 0];
+		for (i = 0; i < 8; i++)
+			state[i][j] = sctx->state[i];
+	}
+
+	/* Complete the block left over in @sctx first. */
+	if (partial && partial + len >= SHA256_BLOCK_SIZE) {
+		done = SHA256_BLOCK_SIZE - partial;
+		for (j = 0; j < SHA256_MB_LANES; j++) {
+			memcpy(tail[j], sctx->buf, partial);
+			memcpy(tail[j] + partial, msg[j], done);
+			ptrs[j] = tail[j];
+		}
+		sha256_mb_transform_ssse3(state, ptrs, 1);
+		partial = 0;
+	}
+
+	blocks = (len - done) / SHA256_BLOCK_SIZE;
+	if (blocks) {
+		for (j = 0; j < SHA256_MB_LANES; j++)
+			ptrs[j] = msg[j] + done;
+		sha256_mb_transform_ssse3(state, ptrs, blocks);
+		done += blocks * SHA256_BLOCK_SIZE;
+	}
+
+	/* Pad out what is left, which is less than a block. */
+	rest = partial + len - done;
+	blocks = rest < SHA256_BLOCK_SIZE - sizeof(bits) ? 1 : 2;
+	for (j = 0; j < SHA256_MB_LANES; j++) {
+		memcpy(tail[j], sctx->buf, partial);
+		memcpy(tail[j] + partial, msg[j] + done, len - done);
+		memset(tail[j] + rest, 0, sizeof(tail[j]) - rest);
+		tail[j][rest] = 0x80;
+		memcpy(tail[j] + blocks * SHA256_BLOCK_SIZE - sizeof(bits),
+		       &bits, sizeof(bits));
+		ptrs[j] = tail[j];
+	}
+	sha256_mb_transform_ssse3(state, ptrs, blocks);
+
+	for (j = 0; j < num; j++) {
+		__be32 *dst = (__be32 *)outs[j];
+
+		for (i = 0; i < 8; i++)
+			dst[i] = cpu_to_be32(state[i][j]);
+	}
+
+	memset(state, 0, sizeof(state));
+	memset(tail, 0, sizeof(tail));
+}
+
+static int sha256_ssse3_finup_mb(struct shash_desc *desc,
+				 const u8 * const data[], unsigned int len,
+				 u8 * const outs[], unsigned int num)
+{
+	/*
+	 * A lane costs about as much as a scalar pass over the same data, so
+	 * batches of fewer than three messages are better left serial.
+	 */
+	if (num < 3 || !irq_fpu_usable())
+		return shash_finup_mb_serial(desc, data, len, outs, num);
+
+	kernel_fpu_begin();
+	__sha256_ssse3_finup_mb(shash_desc_ctx(desc), data, len, outs, num);
+	kernel_fpu_end();
+
+	return 0;
+}
+
+static int sha256_ssse3_export(struct shash_desc *desc, void *out)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+
+	memcpy(out, sctx, sizeof(*sctx));
+
+	return 0;
+}
+
+static int sha256_ssse3_import(struct shash_desc *desc, const void *in)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+
+	memcpy(sctx, in, sizeof(*sctx));
+
+	return 0;
+}
+
+static struct shash_alg alg = {
+	.digestsize	=	SHA256_DIGEST_SIZE,
+	.init		=	sha256_ssse3_init,
+	.update		=	sha256_ssse3_update,
+	.final		=	sha256_ssse3_final,
+	.finup_mb	=	sha256_ssse3_finup_mb,
+	.export		=	sha256_ssse3_export,
+	.import		=	sha256_ssse3_import,
+	.descsize	=	sizeof(struct sha256_state),
+	.mb_max_msgs	=	SHA256_MB_LANES,
+	.statesize	=	sizeof(struct sha256_state),
+	.base		=	{
+		.cra_name	=	"sha256",
+		.cra_driver_name=	"sha256-ssse3",
+		.cra_priority	=	150,
+		.cra_flags	=	CRYPTO_ALG_TYPE_SHASH,
+		.cra_blocksize	=	SHA256_BLOCK_SIZE,
+		.cra_module	=	THIS_MODULE,
+	}
+};
+
+static int __init sha256_ssse3_mod_init(void)
+{
+	if (!boot_cpu_has(X86_FEATURE_SSSE3)) {
+		pr_info("SSSE3 instructions are not detected.\n");
+		return -ENODEV;
+	}
+
+	return crypto_register_shash(&alg);
+}
+
+static void __exit sha256_ssse3_mod_fini(void)
+{
+	crypto_unregister_shash(&alg);
+}
+
+module_init(sha256_ssse3_mod_init);
+module_exit(sha256_ssse3_mod_fini);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("SHA256 Secure Hash Algorithm, SSSE3 accelerated");
+
+MODULE_ALIAS("sha256");
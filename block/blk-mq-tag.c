@@ -0,0 +1,112 @@
+/*
+ * Tag allocation for the multi-queue block layer.  Each hardware queue
+ * owns a bitmap of tags, one per preallocated request.  Allocation is a
+ * lockless bit search starting from a per-cpu hint, so cpus submitting
+ * to the same hardware queue tend to work in different words of the map.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+
+#include "blk-mq-tag.h"
+
+struct blk_mq_tags {
+	unsigned int nr_tags;
+	unsigned int __percpu *hint;	/* where to start looking */
+	wait_queue_head_t wait;		/* tag waiters */
+	unsigned long map[];
+};
+
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags, int node)
+{
+	struct blk_mq_tags *tags;
+	unsigned int cpu;
+
+	tags = kzalloc_node(sizeof(*tags) +
+			    BITS_TO_LONGS(nr_tags) * sizeof(unsigned long),
+			    GFP_KERNEL, node);
+	if (!tags)
+		return NULL;
+
+	tags->hint = alloc_percpu(unsigned int);
+	if (!tags->hint) {
+		kfree(tags);
+		return NULL;
+	}
+
+	/* spread the starting points across the map */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(tags->hint, cpu) = (cpu * BITS_PER_LONG) % nr_tags;
+
+	tags->nr_tags = nr_tags;
+	init_waitqueue_head(&tags->wait);
+	return tags;
+}
+
+void blk_mq_free_tags(struct blk_mq_tags *tags)
+{
+	free_percpu(tags->hint);
+	kfree(tags);
+}
+
+static unsigned int __blk_mq_get_tag(struct blk_mq_tags *tags)
+{
+	unsigned int *hint = get_cpu_ptr(tags->hint);
+	unsigned int start = *hint, tag;
+
+	tag = start;
+	do {
+		tag = find_next_zero_bit(tags->map, tags->nr_tags, tag);
+		if (tag >= tags->nr_tags) {
+			if (!start)
+				break;
+			/* wrap around once */
+			tag = find_next_zero_bit(tags->map, start, 0);
+			if (tag >= start)
+				break;
+		}
+		if (!test_and_set_bit(tag, tags->map)) {
+			*hint = tag + 1 < tags->nr_tags ? tag + 1 : 0;
+			put_cpu_ptr(tags->hint);
+			return tag;
+		}
+	} while (1);
+
+	put_cpu_ptr(tags->hint);
+	return BLK_MQ_TAG_FAIL;
+}
+
+/*
+ * Get a free tag.  If @gfp allows sleeping, wait for one to be released
+ * rather than fail.
+ */
+unsigned int blk_mq_get_tag(struct blk_mq_tags *tags, gfp_t gfp)
+{
+	unsigned int tag;
+
+	tag = __blk_mq_get_tag(tags);
+	if (tag != BLK_MQ_TAG_FAIL || !(gfp & __GFP_WAIT))
+		return tag;
+
+	wait_event(tags->wait,
+		   (tag = __blk_mq_get_tag(tags)) != BLK_MQ_TAG_FAIL);
+	return tag;
+}
+
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag)
+{
+	BUG_ON(tag >= tags->nr_tags);
+
+	clear_bit(tag, tags->map);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&tags->wait))
+		wake_up(&tags->wait);
+}
+
+unsigned int blk_mq_tags_busy(struct blk_mq_tags *tags)
+{
+	return bitmap_weight(tags->map, tags->nr_tags);
+}
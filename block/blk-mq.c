@@ -0,0 +1,798 @@
+/*
+ * Multi-queue block layer.  Submitters queue requests on a per-cpu
+ * software queue without touching the request_queue lock, and each
+ * software queue feeds one of the driver's hardware dispatch queues.
+ * Requests are preallocated per hardware queue and identified by a tag.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+
+#include <trace/events/block.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+#include "blk-mq-tag.h"
+
+/* how far back a new bio looks in its software queue for a merge */
+#define BLK_MQ_MERGE_DEPTH	8
+
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+EXPORT_SYMBOL(blk_mq_map_queue);
+
+static struct blk_mq_hw_ctx *blk_mq_ctx_to_hctx(struct blk_mq_ctx *ctx)
+{
+	struct request_queue *q = ctx->queue;
+
+	return q->mq_ops->map_queue(q, ctx->cpu);
+}
+
+static struct request *__blk_mq_alloc_request(struct blk_mq_ctx *ctx,
+					      int rw_flags, gfp_t gfp)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_ctx_to_hctx(ctx);
+	struct request *rq;
+	unsigned int tag;
+
+	tag = blk_mq_get_tag(hctx->tags, gfp);
+	if (tag == BLK_MQ_TAG_FAIL)
+		return NULL;
+
+	rq = hctx->rqs[tag];
+	blk_rq_init(ctx->queue, rq);
+	rq->tag = tag;
+	rq->mq_ctx = ctx;
+	rq->cmd_flags = rw_flags;
+	return rq;
+}
+
+struct request *blk_mq_alloc_request(struct request_queue *q, int rw,
+				     gfp_t gfp)
+{
+	return __blk_mq_alloc_request(blk_mq_get_ctx(q), rw, gfp);
+}
+EXPORT_SYMBOL(blk_mq_alloc_request);
+
+void blk_mq_free_request(struct request *rq)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_ctx_to_hctx(rq->mq_ctx);
+
+	/* this is a bio leak */
+	WARN_ON(rq->bio != NULL);
+
+	blk_mq_put_tag(hctx->tags, rq->tag);
+}
+EXPORT_SYMBOL(blk_mq_free_request);
+
+/*
+ * Account the completion latency of a request issued while polling was
+ * enabled, and fold it into the running average the hybrid sleep uses.
+ * The average is updated without locking; a lost update does no harm.
+ */
+static void blk_mq_poll_stat_add(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+	u64 now = ktime_to_ns(ktime_get());
+	unsigned long lat_ns, lat_us, mean;
+	int bucket;
+
+	lat_ns = now > rq->issue_time_ns ? now - rq->issue_time_ns : 0;
+	lat_us = lat_ns / NSEC_PER_USEC;
+	bucket = lat_us ? min(ilog2(lat_us) + 1, BLK_MQ_POLL_LAT_BUCKETS - 1) : 0;
+	this_cpu_inc(q->poll_stat->lat[bucket]);
+
+	mean = ACCESS_ONCE(q->poll_mean_ns);
+	q->poll_mean_ns = mean ? mean - mean / 8 + lat_ns / 8 : lat_ns;
+}
+
+/**
+ * blk_mq_end_io - complete a request issued through ->queue_rq()
+ * @rq:		the request
+ * @error:	0 for success, < 0 for error
+ *
+ * Description:
+ *    Ends all bios of @rq and releases its tag, or hands @rq to its
+ *    ->end_io() callback which then owns it.  May be called from
+ *    interrupt context.
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	if (rq->issue_time_ns)
+		blk_mq_poll_stat_add(rq);
+
+	if (blk_update_request(rq, error, blk_rq_bytes(rq)))
+		BUG();
+
+	if (rq->end_io)
+		rq->end_io(rq, error);
+	else
+		blk_mq_free_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_end_io);
+
+static void blk_mq_start_request(struct request *rq)
+{
+	trace_block_rq_issue(rq->q, rq);
+
+	rq->resid_len = blk_rq_bytes(rq);
+	rq->cmd_flags |= REQ_STARTED;
+	if (blk_queue_poll(rq->q))
+		rq->issue_time_ns = ktime_to_ns(ktime_get());
+	rq->mq_ctx->rq_dispatched[rq_is_sync(rq)]++;
+}
+
+static void __blk_mq_insert_request(struct blk_mq_hw_ctx *hctx,
+				    struct request *rq, bool at_head)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	unsigned long flags;
+
+	trace_block_rq_insert(rq->q, rq);
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	if (at_head)
+		list_add(&rq->queuelist, &ctx->rq_list);
+	else
+		list_add_tail(&rq->queuelist, &ctx->rq_list);
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	/* Set after queueing, so a run that misses the bit misses no work */
+	set_bit(ctx->index_hw, hctx->ctx_map);
+}
+
+/**
+ * blk_mq_insert_request - queue a request on its software queue
+ * @rq:		the request
+ * @at_head:	queue at the head instead of the tail
+ * @run_queue:	run the hardware queue afterwards
+ * @async:	run the hardware queue from kblockd
+ */
+void blk_mq_insert_request(struct request *rq, bool at_head, bool run_queue,
+			   bool async)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_ctx_to_hctx(rq->mq_ctx);
+
+	__blk_mq_insert_request(hctx, rq, at_head);
+	if (run_queue)
+		blk_mq_run_hw_queue(hctx, async);
+}
+EXPORT_SYMBOL(blk_mq_insert_request);
+
+/*
+ * Pull everything pending on the software queues mapped to @hctx, plus
+ * anything the driver bounced last time, and feed it to ->queue_rq().
+ */
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	LIST_HEAD(rq_list);
+	int bit;
+
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	for_each_set_bit(bit, hctx->ctx_map, hctx->nr_ctx) {
+		if (!test_and_clear_bit(bit, hctx->ctx_map))
+			continue;
+
+		ctx = hctx->ctxs[bit];
+		spin_lock_irq(&ctx->lock);
+		list_splice_tail_init(&ctx->rq_list, &rq_list);
+		spin_unlock_irq(&ctx->lock);
+	}
+
+	/*
+	 * Requests the driver could not take last time go out first.
+	 */
+	if (!list_empty_careful(&hctx->dispatch)) {
+		spin_lock_irq(&hctx->lock);
+		list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock_irq(&hctx->lock);
+	}
+
+	while (!list_empty(&rq_list)) {
+		int ret;
+
+		rq = list_first_entry(&rq_list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		blk_mq_start_request(rq);
+
+		ret = q->mq_ops->queue_rq(hctx, rq);
+		if (ret == BLK_MQ_RQ_QUEUE_OK)
+			continue;
+
+		if (ret == BLK_MQ_RQ_QUEUE_BUSY) {
+			rq->cmd_flags &= ~REQ_STARTED;
+			list_add(&rq->queuelist, &rq_list);
+			break;
+		}
+
+		if (ret != BLK_MQ_RQ_QUEUE_ERROR)
+			printk(KERN_ERR "blk-mq: bad return on queue: %d\n",
+			       ret);
+		rq->errors = -EIO;
+		blk_mq_end_io(rq, rq->errors);
+	}
+
+	if (list_empty(&rq_list))
+		return;
+
+	spin_lock_irq(&hctx->lock);
+	list_splice(&rq_list, &hctx->dispatch);
+	spin_unlock_irq(&hctx->lock);
+
+	/*
+	 * The driver stopped the queue when it returned busy.  If it has
+	 * already restarted it, that run may have missed the requests we
+	 * just parked, so go again.
+	 */
+	if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+		blk_mq_run_hw_queue(hctx, true);
+}
+
+static void blk_mq_run_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx =
+		container_of(work, struct blk_mq_hw_ctx, run_work);
+
+	__blk_mq_run_hw_queue(hctx);
+}
+
+/**
+ * blk_mq_run_hw_queue - dispatch pending requests of a hardware queue
+ * @hctx:	the hardware queue
+ * @async:	leave the dispatch to kblockd
+ *
+ * Description:
+ *    A synchronous run calls ->queue_rq() from the caller's context,
+ *    which must be allowed to sleep.
+ */
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (!async)
+		__blk_mq_run_hw_queue(hctx);
+	else
+		kblockd_schedule_work(hctx->queue, &hctx->run_work);
+}
+EXPORT_SYMBOL(blk_mq_run_hw_queue);
+
+static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
+{
+	return !list_empty_careful(&hctx->dispatch) ||
+		find_first_bit(hctx->ctx_map, hctx->nr_ctx) < hctx->nr_ctx;
+}
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (blk_mq_hctx_has_pending(hctx))
+			blk_mq_run_hw_queue(hctx, async);
+	}
+}
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+void blk_mq_start_stopped_hw_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (test_and_clear_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			blk_mq_run_hw_queue(hctx, async);
+	}
+}
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+/*
+ * Sleep for part of the expected completion time before spinning: the
+ * fixed io_poll_delay, or half the average latency in hybrid mode.
+ * Returns true if we slept.
+ */
+static bool blk_mq_poll_hybrid_sleep(struct request_queue *q)
+{
+	unsigned long nsecs;
+	ktime_t expires;
+
+	if (q->poll_nsec < 0)
+		return false;
+
+	nsecs = q->poll_nsec ? q->poll_nsec : ACCESS_ONCE(q->poll_mean_ns) / 2;
+	if (!nsecs)
+		return false;
+
+	this_cpu_inc(q->poll_stat->slept);
+	expires = ktime_set(0, nsecs);
+	schedule_hrtimeout(&expires, HRTIMER_MODE_REL);
+	return true;
+}
+
+/**
+ * blk_poll - busy wait for completions instead of sleeping
+ * @q:		the queue the caller waits on
+ * @may_sleep:	allow the hybrid sleep before spinning
+ *
+ * Description:
+ *    For synchronous submitters on low latency devices, reaping the
+ *    completion from the hardware queue of the local cpu is cheaper than
+ *    an interrupt and a wakeup.  The caller must have set its task state
+ *    as for a sleep, so that the completion it is waiting for ends the
+ *    spin by making it runnable.  Returns true if the caller should
+ *    recheck its wait condition, false if it should go to sleep, which
+ *    is also the answer when io_poll is off.  Only pass @may_sleep for
+ *    the first call in a wait, otherwise the caller just sleeps again.
+ */
+bool blk_poll(struct request_queue *q, bool may_sleep)
+{
+	struct blk_mq_hw_ctx *hctx;
+	long state;
+
+	if (!q->mq_ops || !q->mq_ops->poll || !blk_queue_poll(q))
+		return false;
+
+	if (may_sleep && blk_mq_poll_hybrid_sleep(q))
+		return true;
+
+	this_cpu_inc(q->poll_stat->invoked);
+	hctx = q->mq_ops->map_queue(q, raw_smp_processor_id());
+	state = current->state;
+
+	while (!need_resched()) {
+		int ret = q->mq_ops->poll(hctx);
+
+		if (ret > 0) {
+			this_cpu_inc(q->poll_stat->success);
+			__set_current_state(TASK_RUNNING);
+			return true;
+		}
+
+		if (signal_pending_state(state, current))
+			__set_current_state(TASK_RUNNING);
+		if (current->state == TASK_RUNNING)
+			return true;
+		if (ret < 0)
+			break;
+		cpu_relax();
+	}
+
+	return false;
+}
+EXPORT_SYMBOL_GPL(blk_poll);
+
+ssize_t blk_mq_poll_stat_show(struct request_queue *q, char *page)
+{
+	struct blk_mq_poll_stat sum;
+	char *p = page;
+	int cpu, i;
+
+	if (!q->poll_stat)
+		return 0;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		struct blk_mq_poll_stat *stat = per_cpu_ptr(q->poll_stat, cpu);
+
+		sum.invoked += stat->invoked;
+		sum.success += stat->success;
+		sum.slept += stat->slept;
+		for (i = 0; i < BLK_MQ_POLL_LAT_BUCKETS; i++)
+			sum.lat[i] += stat->lat[i];
+	}
+
+	p += sprintf(p, "invoked %lu\nsuccess %lu\nslept %lu\nmean_ns %lu\n",
+		     sum.invoked, sum.success, sum.slept, q->poll_mean_ns);
+	p += sprintf(p, "lat_us <1 %lu\n", sum.lat[0]);
+	for (i = 1; i < BLK_MQ_POLL_LAT_BUCKETS - 1; i++)
+		p += sprintf(p, "lat_us <%u %lu\n", 1U << i, sum.lat[i]);
+	p += sprintf(p, "lat_us >=%u %lu\n", 1U << (i - 1), sum.lat[i]);
+
+	return p - page;
+}
+
+/*
+ * Try to merge @bio into one of the last few requests on the software
+ * queue.  Only the per-cpu queue lock is taken.
+ */
+static bool blk_mq_attempt_merge(struct request_queue *q,
+				 struct blk_mq_ctx *ctx, struct bio *bio)
+{
+	struct request *rq;
+	int checked = BLK_MQ_MERGE_DEPTH;
+	bool merged = false;
+
+	spin_lock_irq(&ctx->lock);
+	list_for_each_entry_reverse(rq, &ctx->rq_list, queuelist) {
+		if (!checked--)
+			break;
+
+		if (!elv_rq_merge_ok(rq, bio))
+			continue;
+
+		if (blk_rq_pos(rq) + blk_rq_sectors(rq) == bio->bi_sector)
+			merged = bio_attempt_back_merge(q, rq, bio);
+		else if (blk_rq_pos(rq) - bio_sectors(bio) == bio->bi_sector)
+			merged = bio_attempt_front_merge(q, rq, bio);
+
+		if (merged) {
+			ctx->rq_merged++;
+			break;
+		}
+	}
+	spin_unlock_irq(&ctx->lock);
+
+	return merged;
+}
+
+static void __blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	const bool sync = !!(bio->bi_rw & REQ_SYNC);
+	const bool unplug = !!(bio->bi_rw & REQ_UNPLUG);
+	struct blk_plug *plug = current->plug;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	int rw_flags;
+
+	if (plug && attempt_plug_merge(current, q, bio)) {
+		if (unplug)
+			blk_flush_plug_list(plug, false);
+		return;
+	}
+
+	ctx = blk_mq_get_ctx(q);
+	if (!blk_queue_nomerges(q) && blk_mq_attempt_merge(q, ctx, bio))
+		return;
+
+	rw_flags = bio_data_dir(bio);
+	if (sync)
+		rw_flags |= REQ_SYNC;
+
+	/* may sleep waiting for a tag, but can not fail */
+	rq = __blk_mq_alloc_request(ctx, rw_flags, GFP_NOIO);
+	init_request_from_bio(rq, bio);
+
+	if (plug) {
+		blk_plug_add_request(plug, rq, unplug);
+		return;
+	}
+
+	blk_mq_insert_request(rq, false, true, !(sync || unplug));
+}
+
+struct blk_mq_sync {
+	struct completion	done;
+	int			error;
+};
+
+static void blk_mq_sync_end_io(struct request *rq, int error)
+{
+	struct blk_mq_sync *sync = rq->end_io_data;
+
+	sync->error = error;
+	complete(&sync->done);
+}
+
+static void blk_mq_sync_bio_end_io(struct bio *bio, int error)
+{
+	struct blk_mq_sync *sync = bio->bi_private;
+
+	sync->error = error;
+	complete(&sync->done);
+}
+
+/*
+ * Send an empty flush to the device backing @bio and wait for it.
+ */
+static int blk_mq_issue_flush(struct request_queue *q, struct bio *bio)
+{
+	struct blk_mq_sync sync;
+	struct request *rq;
+
+	rq = blk_mq_alloc_request(q, WRITE, GFP_NOIO);
+	rq->cmd_type = REQ_TYPE_FS;
+	rq->cmd_flags |= REQ_FLUSH | REQ_SYNC;
+	rq->rq_disk = bio->bi_bdev->bd_disk;
+
+	init_completion(&sync.done);
+	rq->end_io = blk_mq_sync_end_io;
+	rq->end_io_data = &sync;
+
+	blk_mq_insert_request(rq, false, true, false);
+	wait_for_completion(&sync.done);
+	blk_mq_free_request(rq);
+
+	return sync.error;
+}
+
+/*
+ * Multi-queue drivers have no flush sequencer in front of them.  Issue
+ * REQ_FLUSH as a separate empty flush before the data, and emulate
+ * REQ_FUA on devices without it by flushing after the data completed.
+ * Both waits happen in the submitter's context.
+ */
+static void blk_mq_flush_bio(struct request_queue *q, struct bio *bio)
+{
+	const bool preflush = !!(bio->bi_rw & REQ_FLUSH);
+	const bool postflush = (bio->bi_rw & REQ_FUA) &&
+				!(q->flush_flags & REQ_FUA);
+	bio_end_io_t *end_io = bio->bi_end_io;
+	void *private = bio->bi_private;
+	struct blk_mq_sync sync;
+	int error = 0;
+
+	if (preflush) {
+		error = blk_mq_issue_flush(q, bio);
+		if (error)
+			goto out;
+	}
+
+	bio->bi_rw &= ~REQ_FLUSH;
+	if (postflush)
+		bio->bi_rw &= ~REQ_FUA;
+
+	if (!bio->bi_size)
+		goto out;
+
+	if (!postflush) {
+		__blk_mq_make_request(q, bio);
+		return;
+	}
+
+	init_completion(&sync.done);
+	bio->bi_end_io = blk_mq_sync_bio_end_io;
+	bio->bi_private = &sync;
+	__blk_mq_make_request(q, bio);
+	wait_for_completion(&sync.done);
+	bio->bi_end_io = end_io;
+	bio->bi_private = private;
+
+	error = sync.error;
+	if (!error)
+		error = blk_mq_issue_flush(q, bio);
+out:
+	bio_endio(bio, error);
+}
+
+static int blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	/*
+	 * low level driver can indicate that it wants pages above a
+	 * certain limit bounced to low memory (ie for highmem, or even
+	 * ISA dma in theory)
+	 */
+	blk_queue_bounce(q, &bio);
+
+	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA))
+		blk_mq_flush_bio(q, bio);
+	else
+		__blk_mq_make_request(q, bio);
+
+	return 0;
+}
+
+static void blk_mq_free_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	if (hctx->rqs) {
+		for (i = 0; i < hctx->queue_depth; i++)
+			kfree(hctx->rqs[i]);
+		kfree(hctx->rqs);
+	}
+	if (hctx->tags)
+		blk_mq_free_tags(hctx->tags);
+	kfree(hctx->ctx_map);
+	kfree(hctx->ctxs);
+	free_cpumask_var(hctx->cpumask);
+	kfree(hctx);
+}
+
+static struct blk_mq_hw_ctx *blk_mq_alloc_hctx(struct request_queue *q,
+					       struct blk_mq_reg *reg,
+					       unsigned int hctx_idx)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i, rq_size;
+	int node = reg->numa_node;
+
+	hctx = kzalloc_node(sizeof(*hctx), GFP_KERNEL, node);
+	if (!hctx)
+		return NULL;
+
+	spin_lock_init(&hctx->lock);
+	INIT_LIST_HEAD(&hctx->dispatch);
+	INIT_WORK(&hctx->run_work, blk_mq_run_work_fn);
+	hctx->queue = q;
+	hctx->queue_num = hctx_idx;
+	hctx->queue_depth = reg->queue_depth;
+
+	if (!zalloc_cpumask_var(&hctx->cpumask, GFP_KERNEL))
+		goto fail;
+
+	hctx->ctxs = kmalloc_node(nr_cpu_ids * sizeof(void *), GFP_KERNEL,
+				  node);
+	hctx->ctx_map = kzalloc_node(BITS_TO_LONGS(nr_cpu_ids) *
+				     sizeof(unsigned long), GFP_KERNEL, node);
+	hctx->tags = blk_mq_init_tags(reg->queue_depth, node);
+	hctx->rqs = kzalloc_node(reg->queue_depth * sizeof(struct request *),
+				 GFP_KERNEL, node);
+	if (!hctx->ctxs || !hctx->ctx_map || !hctx->tags || !hctx->rqs)
+		goto fail;
+
+	/* the driver's per-request data sits right behind the request */
+	rq_size = sizeof(struct request) + reg->cmd_size;
+	for (i = 0; i < reg->queue_depth; i++) {
+		hctx->rqs[i] = kzalloc_node(rq_size, GFP_KERNEL, node);
+		if (!hctx->rqs[i])
+			goto fail;
+	}
+
+	return hctx;
+fail:
+	blk_mq_free_hctx(hctx);
+	return NULL;
+}
+
+/*
+ * Set up the per-cpu software queues and map each onto a hardware queue.
+ * Consecutive cpus share a hardware queue, which keeps siblings and
+ * node-local cpus together on the usual topologies.
+ */
+static void blk_mq_map_swqueues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_mq_ctx *ctx = __blk_mq_get_ctx(q, cpu);
+
+		memset(ctx, 0, sizeof(*ctx));
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+
+		q->mq_map[cpu] = cpu * q->nr_hw_queues / nr_cpu_ids;
+		hctx = q->mq_ops->map_queue(q, cpu);
+		cpumask_set_cpu(cpu, hctx->cpumask);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+}
+
+/**
+ * blk_mq_init_queue - set up a multi-queue request queue
+ * @reg:	hardware queue count, depth and driver operations
+ * @driver_data: stored in q->queuedata
+ *
+ * Description:
+ *    Returns the new queue, or an ERR_PTR.  The queue is torn down with
+ *    blk_cleanup_queue() like any other.
+ */
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	struct request_queue *q;
+	int i, err = -ENOMEM;
+
+	if (!reg->nr_hw_queues || !reg->ops->queue_rq ||
+	    !reg->ops->map_queue || !reg->queue_depth ||
+	    reg->queue_depth > BLK_MQ_MAX_DEPTH)
+		return ERR_PTR(-EINVAL);
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		return ERR_PTR(-ENOMEM);
+
+	q->mq_ops = reg->ops;
+	q->queuedata = driver_data;
+	q->nr_hw_queues = reg->nr_hw_queues;
+
+	q->poll_nsec = -1;
+
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->poll_stat = alloc_percpu(struct blk_mq_poll_stat);
+	q->queue_hw_ctx = kzalloc_node(reg->nr_hw_queues * sizeof(void *),
+				       GFP_KERNEL, reg->numa_node);
+	q->mq_map = kzalloc_node(nr_cpu_ids * sizeof(unsigned int),
+				 GFP_KERNEL, reg->numa_node);
+	if (!q->queue_ctx || !q->poll_stat || !q->queue_hw_ctx || !q->mq_map)
+		goto fail;
+
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		q->queue_hw_ctx[i] = blk_mq_alloc_hctx(q, reg, i);
+		if (!q->queue_hw_ctx[i])
+			goto fail;
+	}
+
+	blk_mq_map_swqueues(q);
+
+	blk_queue_make_request(q, blk_mq_make_request);
+
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		struct blk_mq_hw_ctx *hctx = q->queue_hw_ctx[i];
+
+		if (!reg->ops->init_hctx)
+			break;
+		err = reg->ops->init_hctx(hctx, driver_data, i);
+		if (err) {
+			while (--i >= 0 && reg->ops->exit_hctx)
+				reg->ops->exit_hctx(q->queue_hw_ctx[i], i);
+			goto fail;
+		}
+	}
+
+	return q;
+fail:
+	/* don't call ->exit_hctx() from blk_mq_free_queue() */
+	q->mq_ops = NULL;
+	blk_mq_free_queue(q);
+	blk_cleanup_queue(q);
+	return ERR_PTR(err);
+}
+EXPORT_SYMBOL(blk_mq_init_queue);
+
+void blk_mq_sync_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		cancel_work_sync(&hctx->run_work);
+}
+
+/*
+ * Called when the last reference to the queue is dropped.
+ */
+void blk_mq_free_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	if (q->queue_hw_ctx) {
+		for (i = 0; i < q->nr_hw_queues; i++) {
+			hctx = q->queue_hw_ctx[i];
+			if (!hctx)
+				continue;
+			cancel_work_sync(&hctx->run_work);
+			if (q->mq_ops && q->mq_ops->exit_hctx)
+				q->mq_ops->exit_hctx(hctx, i);
+			blk_mq_free_hctx(hctx);
+		}
+		kfree(q->queue_hw_ctx);
+		q->queue_hw_ctx = NULL;
+	}
+
+	q->nr_hw_queues = 0;
+	kfree(q->mq_map);
+	q->mq_map = NULL;
+	free_percpu(q->queue_ctx);
+	q->queue_ctx = NULL;
+	free_percpu(q->poll_stat);
+	q->poll_stat = NULL;
+}
@@ -0,0 +1,55 @@
+#ifndef INT_BLK_MQ_H
+#define INT_BLK_MQ_H
+
+/*
+ * Per-cpu software submission queue
+ */
+struct blk_mq_ctx {
+	spinlock_t		lock;
+	struct list_head	rq_list;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;	/* index in hctx->ctxs */
+
+	unsigned long		rq_merged;
+	unsigned long		rq_dispatched[2];
+
+	struct request_queue	*queue;
+} ____cacheline_aligned_in_smp;
+
+static inline struct blk_mq_ctx *__blk_mq_get_ctx(struct request_queue *q,
+						  unsigned int cpu)
+{
+	return per_cpu_ptr(q->queue_ctx, cpu);
+}
+
+/*
+ * This assumes per-cpu software queueing queues. They could be per-node
+ * as well, for instance. For now this is hardcoded as-is. Note that we don't
+ * care about preemption, since we know the ctx's are persistent. This does
+ * mean that we can't rely on ctx always matching the currently running CPU.
+ */
+static inline struct blk_mq_ctx *blk_mq_get_ctx(struct request_queue *q)
+{
+	return __blk_mq_get_ctx(q, raw_smp_processor_id());
+}
+
+/*
+ * Polling statistics, kept per cpu.  lat[] is a log2 histogram of the
+ * issue to completion time in usecs: lat[0] counts < 1us, lat[i] counts
+ * [2^(i-1), 2^i) and the last bucket everything above.
+ */
+#define BLK_MQ_POLL_LAT_BUCKETS	16
+
+struct blk_mq_poll_stat {
+	unsigned long		invoked;	/* blk_poll() spins */
+	unsigned long		success;	/* spins that reaped completions */
+	unsigned long		slept;		/* hybrid sleeps */
+	unsigned long		lat[BLK_MQ_POLL_LAT_BUCKETS];
+};
+
+void blk_mq_free_queue(struct request_queue *q);
+void blk_mq_sync_queue(struct request_queue *q);
+ssize_t blk_mq_poll_stat_show(struct request_queue *q, char *page);
+
+#endif
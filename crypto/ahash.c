@@ -274,6 +274,41 @@ int crypto_ahash_digest(struct ahash_request *req)
 }
 EXPORT_SYMBOL_GPL(crypto_ahash_digest);
 
+/**
+ * crypto_ahash_digest_mb() - digest several independent requests
+ * @reqs: the requests, all on the same transform
+ * @num: number of requests
+ *
+ * Transforms backed by a synchronous hash interleave requests of equal
+ * length where they can.  Returns 0 if every request completed, otherwise
+ * the first error; -EINPROGRESS means some requests will still complete
+ * through their callbacks.
+ */
+int crypto_ahash_digest_mb(struct ahash_request **reqs, unsigned int num)
+{
+	if (!num)
+		return 0;
+
+	return crypto_ahash_reqtfm(reqs[0])->digest_mb(reqs, num);
+}
+EXPORT_SYMBOL_GPL(crypto_ahash_digest_mb);
+
+static int ahash_def_digest_mb(struct ahash_request **reqs, unsigned int num)
+{
+	unsigned int i;
+	int err, ret = 0;
+
+	for (i = 0; i < num; i++) {
+		err = crypto_ahash_digest(reqs[i]);
+		if (err == -EINPROGRESS || err == -EBUSY)
+			ret = -EINPROGRESS;
+		else if (err)
+			return err;
+	}
+
+	return ret;
+}
+
 static void ahash_def_finup_finish2(struct ahash_request *req, int err)
 {
 	struct ahash_request_priv *priv = req->priv;
@@ -378,6 +413,7 @@ static int crypto_ahash_init_tfm(struct crypto_tfm *tfm)
 	hash->final = alg->final;
 	hash->finup = alg->finup ?: ahash_def_finup;
 	hash->digest = alg->digest;
+	hash->digest_mb = ahash_def_digest_mb;
 
 	if (alg->setkey)
 		hash->setkey = alg->setkey;
@@ -183,6 +183,77 @@ int crypto_shash_digest(struct shash_desc *desc, const u8 *data,
 }
 EXPORT_SYMBOL_GPL(crypto_shash_digest);
 
+/*
+ * Hashes each message on its own, starting from a copy of @desc.  This is
+ * the fallback for algorithms which cannot interleave several messages.
+ */
+int shash_finup_mb_serial(struct shash_desc *desc, const u8 * const data[],
+			  unsigned int len, u8 * const outs[], unsigned int num)
+{
+	struct crypto_shash *tfm = desc->tfm;
+	char buf[sizeof(*desc) + crypto_shash_descsize(tfm)]
+		CRYPTO_MINALIGN_ATTR;
+	struct shash_desc *tmp = (void *)buf;
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < num && !err; i++) {
+		memcpy(tmp, desc, sizeof(buf));
+		err = crypto_shash_finup(tmp, data[i], len, outs[i]);
+	}
+
+	memset(buf, 0, sizeof(buf));
+	return err;
+}
+EXPORT_SYMBOL_GPL(shash_finup_mb_serial);
+
+/**
+ * crypto_shash_finup_mb() - finish several messages which share a prefix
+ * @desc: state after hashing the common prefix, left untouched
+ * @data: the @num messages, each @len bytes long
+ * @len: length of each message
+ * @outs: where to store the @num digests
+ * @num: number of messages
+ *
+ * Equivalent to calling crypto_shash_finup() on a copy of @desc for each
+ * message, but lets the algorithm interleave up to mb_max_msgs of them.
+ */
+int crypto_shash_finup_mb(struct shash_desc *desc, const u8 * const data[],
+			  unsigned int len, u8 * const outs[],
+			  unsigned int num)
+{
+	struct crypto_shash *tfm = desc->tfm;
+	struct shash_alg *shash = crypto_shash_alg(tfm);
+	unsigned long alignmask = crypto_shash_alignmask(tfm);
+	unsigned int i, n;
+	int err;
+
+	for (i = 0; i < num; i++)
+		if (((unsigned long)data[i] | (unsigned long)outs[i]) &
+		    alignmask)
+			return shash_finup_mb_serial(desc, data, len, outs,
+						     num);
+
+	for (; num; data += n, outs += n, num -= n) {
+		n = min(num, shash->mb_max_msgs);
+		err = shash->finup_mb(desc, data, len, outs, n);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(crypto_shash_finup_mb);
+
+int crypto_shash_digest_mb(struct shash_desc *desc, const u8 * const data[],
+			   unsigned int len, u8 * const outs[],
+			   unsigned int num)
+{
+	return crypto_shash_init(desc) ?:
+	       crypto_shash_finup_mb(desc, data, len, outs, num);
+}
+EXPORT_SYMBOL_GPL(crypto_shash_digest_mb);
+
 static int shash_default_export(struct shash_desc *desc, void *out)
 {
 	memcpy(out, shash_desc_ctx(desc), crypto_shash_descsize(desc->tfm));
@@ -303,6 +374,72 @@ static int shash_async_digest(struct ahash_request *req)
 	return shash_ahash_digest(req, desc);
 }
 
+/* Bound on the requests gathered for one crypto_shash_digest_mb() call. */
+#define SHASH_ASYNC_MB_MSGS	8
+
+static int shash_async_digest_mb_flush(struct ahash_request *req,
+				       const u8 * const data[],
+				       u8 * const outs[], unsigned int num)
+{
+	struct crypto_shash **ctx;
+	struct shash_desc *desc;
+	int err;
+
+	if (!num)
+		return 0;
+
+	ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+	desc = ahash_request_ctx(req);
+	desc->tfm = *ctx;
+	desc->flags = req->base.flags;
+
+	err = crypto_shash_digest_mb(desc, data, req->nbytes, outs, num);
+	crypto_yield(desc->flags);
+	return err;
+}
+
+/*
+ * Requests whose data sits in one directly mapped page are gathered and
+ * hashed together; anything else takes the ordinary single request path.
+ */
+static int shash_async_digest_mb(struct ahash_request **reqs, unsigned int num)
+{
+	const u8 *data[SHASH_ASYNC_MB_MSGS];
+	u8 *outs[SHASH_ASYNC_MB_MSGS];
+	struct ahash_request *first = NULL;
+	unsigned int i, n = 0;
+	int err;
+
+	for (i = 0; i < num; i++) {
+		struct ahash_request *req = reqs[i];
+		struct scatterlist *sg = req->src;
+
+		if (!req->nbytes || req->nbytes > sg->length ||
+		    sg->offset + req->nbytes > PAGE_SIZE ||
+		    PageHighMem(sg_page(sg)) ||
+		    (first && req->nbytes != first->nbytes)) {
+			err = shash_async_digest(req);
+			if (err)
+				return err;
+			continue;
+		}
+
+		if (!first)
+			first = req;
+		data[n] = page_address(sg_page(sg)) + sg->offset;
+		outs[n++] = req->result;
+
+		if (n == SHASH_ASYNC_MB_MSGS) {
+			err = shash_async_digest_mb_flush(first, data, outs, n);
+			if (err)
+				return err;
+			n = 0;
+		}
+	}
+
+	return shash_async_digest_mb_flush(first, data, outs, n);
+}
+
 static int shash_async_export(struct ahash_request *req, void *out)
 {
 	return crypto_shash_export(ahash_request_ctx(req), out);
@@ -351,6 +488,7 @@ int crypto_init_shash_ops_async(struct crypto_tfm *tfm)
 	crt->final = shash_async_final;
 	crt->finup = shash_async_finup;
 	crt->digest = shash_async_digest;
+	crt->digest_mb = shash_async_digest_mb;
 
 	if (alg->setkey)
 		crt->setkey = shash_async_setkey;
@@ -571,6 +709,12 @@ static int shash_prepare_alg(struct shash_alg *alg)
 		alg->finup = shash_finup_unaligned;
 	if (!alg->digest)
 		alg->digest = shash_digest_unaligned;
+	if (!alg->finup_mb) {
+		alg->finup_mb = shash_finup_mb_serial;
+		alg->mb_max_msgs = 1;
+	}
+	if (!alg->mb_max_msgs)
+		alg->mb_max_msgs = 1;
 	if (!alg->export) {
 		alg->export = shash_default_export;
 		alg->import = shash_default_import;
@@ -28,6 +28,7 @@
 #include <linux/gfp.h>
 #include <linux/module.h>
 #include <linux/scatterlist.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/moduleparam.h>
 #include <linux/jiffies.h>
@@ -474,6 +475,111 @@ out:
 	crypto_free_hash(tfm);
 }
 
+#define MB_HASH_MSGS	8
+
+static int test_mb_hash_jiffies(struct shash_desc *desc, const u8 **data,
+				unsigned int blen, u8 **outs, bool mb, int sec)
+{
+	unsigned long start, end;
+	int bcount, i;
+	int ret;
+
+	for (start = jiffies, end = start + sec * HZ, bcount = 0;
+	     time_before(jiffies, end); bcount += MB_HASH_MSGS) {
+		if (mb) {
+			ret = crypto_shash_digest_mb(desc, data, blen, outs,
+						     MB_HASH_MSGS);
+			if (ret)
+				return ret;
+			continue;
+		}
+		for (i = 0; i < MB_HASH_MSGS; i++) {
+			ret = crypto_shash_digest(desc, data[i], blen, outs[i]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	printk("%s: %8u hashes/sec, %9lu bytes/sec\n",
+	       mb ? "multi-buffer" : "one-by-one  ",
+	       bcount / sec, ((long)bcount * blen) / sec);
+
+	return 0;
+}
+
+/*
+ * Aggregate throughput of hashing MB_HASH_MSGS independent messages, one at
+ * a time and through crypto_shash_digest_mb().
+ */
+static void test_mb_hash_speed(const char *algo, unsigned int sec,
+			       struct hash_speed *speed)
+{
+	static u8 output[MB_HASH_MSGS][64];
+	const u8 *data[MB_HASH_MSGS];
+	u8 *outs[MB_HASH_MSGS];
+	struct crypto_shash *tfm;
+	struct shash_desc *desc;
+	int i;
+	int ret;
+
+	printk(KERN_INFO "\ntesting multi-buffer speed of %s\n", algo);
+
+	tfm = crypto_alloc_shash(algo, 0, 0);
+	if (IS_ERR(tfm)) {
+		printk(KERN_ERR "failed to load transform for %s: %ld\n", algo,
+		       PTR_ERR(tfm));
+		return;
+	}
+
+	printk(KERN_INFO "%s hashes %u messages at a time\n",
+	       crypto_tfm_alg_driver_name(crypto_shash_tfm(tfm)),
+	       crypto_shash_mb_max_msgs(tfm));
+
+	if (crypto_shash_digestsize(tfm) > sizeof(output[0])) {
+		printk(KERN_ERR "digestsize(%u) > outputbuffer(%zu)\n",
+		       crypto_shash_digestsize(tfm), sizeof(output[0]));
+		goto out;
+	}
+
+	desc = kmalloc(sizeof(*desc) + crypto_shash_descsize(tfm),
+		       GFP_KERNEL);
+	if (!desc)
+		goto out;
+	desc->tfm = tfm;
+	desc->flags = 0;
+
+	for (i = 0; i < MB_HASH_MSGS; i++) {
+		data[i] = (u8 *)tvmem[i % TVMEMSIZE];
+		outs[i] = output[i];
+	}
+	for (i = 0; i < TVMEMSIZE; i++)
+		memset(tvmem[i], 0xff, PAGE_SIZE);
+
+	/* Messages are digested whole, so only the single update entries. */
+	for (i = 0; speed[i].blen != 0; i++) {
+		if (speed[i].plen != speed[i].blen)
+			continue;
+		if (speed[i].blen > PAGE_SIZE)
+			break;
+
+		printk(KERN_INFO "test%3u (%5u byte blocks, %u messages)\n",
+		       i, speed[i].blen, MB_HASH_MSGS);
+
+		ret = test_mb_hash_jiffies(desc, data, speed[i].blen, outs,
+					   false, sec ?: 1) ?:
+		      test_mb_hash_jiffies(desc, data, speed[i].blen, outs,
+					   true, sec ?: 1);
+		if (ret) {
+			printk(KERN_ERR "hashing failed ret=%d\n", ret);
+			break;
+		}
+	}
+
+	kfree(desc);
+out:
+	crypto_free_shash(tfm);
+}
+
 struct tcrypt_result {
 	struct completion completion;
 	int err;
@@ -1149,6 +1255,32 @@ static int do_test(int m)
 		test_hash_speed("ghash-generic", sec, hash_speed_template_16);
 		if (mode > 300 && mode < 400) break;
 
+	case 319:
+		test_hash_speed("sha1-generic", sec, generic_hash_speed_template);
+		if (mode > 300 && mode < 400) break;
+
+	case 320:
+		test_hash_speed("sha1-ssse3", sec, generic_hash_speed_template);
+		if (mode > 300 && mode < 400) break;
+
+	case 321:
+		test_hash_speed("sha256-generic", sec,
+				generic_hash_speed_template);
+		if (mode > 300 && mode < 400) break;
+
+	case 322:
+		test_hash_speed("sha256-ssse3", sec,
+				generic_hash_speed_template);
+		if (mode > 300 && mode < 400) break;
+
+	case 323:
+		test_mb_hash_speed("sha256", sec, generic_hash_speed_template);
+		if (mode > 300 && mode < 400) break;
+
+	case 324:
+		test_mb_hash_speed("sha1", sec, generic_hash_speed_template);
+		if (mode > 300 && mode < 400) break;
+
 	case 399:
 		break;
 
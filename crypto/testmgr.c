@@ -21,6 +21,7 @@
  */
 
 #include <crypto/hash.h>
+#include <crypto/internal/hash.h>
 #include <linux/err.h>
 #include <linux/module.h>
 #include <linux/scatterlist.h>
@@ -1433,6 +1434,132 @@ static int alg_test_pcomp(const struct alg_test_desc *desc, const char *driver,
 	return err;
 }
 
+/* Messages per finup_mb() call, more than one batch for most algorithms */
+#define MB_TEST_MSGS	9
+
+/*
+ * Check crypto_shash_finup_mb() and the serial fallback against separate
+ * crypto_shash_finup() calls.  Each vector's plaintext is the shared
+ * prefix, and the messages are variants of it that differ in one byte.
+ */
+static int test_hash_finup_mb(const char *driver, u32 type, u32 mask,
+			      struct hash_testvec *template,
+			      unsigned int tcount)
+{
+	struct crypto_shash *tfm;
+	struct shash_desc *desc, *tmp;
+	const u8 *data[MB_TEST_MSGS];
+	u8 *outs[MB_TEST_MSGS];
+	u8 *msgs, *digests;
+	unsigned int i, j, ds, dsize;
+	int ret = -ENOMEM;
+
+	/* ahash only algorithms have no finup_mb() */
+	tfm = crypto_alloc_shash(driver, type, mask);
+	if (IS_ERR(tfm))
+		return 0;
+
+	ds = crypto_shash_digestsize(tfm);
+	dsize = sizeof(*desc) + crypto_shash_descsize(tfm);
+	desc = kmalloc(dsize, GFP_KERNEL);
+	tmp = kmalloc(dsize, GFP_KERNEL);
+	msgs = kmalloc(MB_TEST_MSGS * 256, GFP_KERNEL);
+	digests = kmalloc((MB_TEST_MSGS + 1) * ds, GFP_KERNEL);
+	if (!desc || !tmp || !msgs || !digests)
+		goto out;
+
+	desc->tfm = tfm;
+	desc->flags = 0;
+
+	for (j = 0; j < MB_TEST_MSGS; j++) {
+		data[j] = msgs + j * 256;
+		outs[j] = digests + j * ds;
+	}
+
+	for (i = 0; i < tcount; i++) {
+		unsigned int len = template[i].psize;
+		u8 *ref = digests + MB_TEST_MSGS * ds;
+		bool serial;
+
+		for (j = 0; j < MB_TEST_MSGS; j++) {
+			u8 *msg = msgs + j * 256;
+
+			memcpy(msg, template[i].plaintext, len);
+			if (len)
+				msg[j % len] ^= j;
+		}
+
+		if (template[i].ksize) {
+			crypto_shash_clear_flags(tfm, ~0);
+			ret = crypto_shash_setkey(tfm, template[i].key,
+						  template[i].ksize);
+			if (ret) {
+				printk(KERN_ERR "alg: hash: setkey failed on "
+				       "finup_mb test %d for %s: ret=%d\n",
+				       i + 1, driver, -ret);
+				goto out;
+			}
+		}
+
+		for (serial = false; ; serial = true) {
+			ret = crypto_shash_init(desc) ?:
+			      crypto_shash_update(desc, template[i].plaintext,
+						  len);
+			if (!ret && serial)
+				ret = shash_finup_mb_serial(desc, data, len,
+							    outs,
+							    MB_TEST_MSGS);
+			else if (!ret)
+				ret = crypto_shash_finup_mb(desc, data, len,
+							    outs,
+							    MB_TEST_MSGS);
+			if (ret) {
+				printk(KERN_ERR "alg: hash: finup_mb%s failed "
+				       "on test %d for %s: ret=%d\n",
+				       serial ? " (serial)" : "", i + 1,
+				       driver, -ret);
+				goto out;
+			}
+
+			for (j = 0; j < MB_TEST_MSGS; j++) {
+				memcpy(tmp, desc, dsize);
+				ret = crypto_shash_finup(tmp, data[j], len,
+							 ref);
+				if (ret) {
+					printk(KERN_ERR "alg: hash: finup "
+					       "failed on finup_mb test %d "
+					       "for %s: ret=%d\n",
+					       i + 1, driver, -ret);
+					goto out;
+				}
+
+				if (memcmp(ref, outs[j], ds)) {
+					printk(KERN_ERR "alg: hash: finup_mb%s "
+					       "test %d failed on message %d "
+					       "for %s\n",
+					       serial ? " (serial)" : "",
+					       i + 1, j, driver);
+					hexdump(outs[j], ds);
+					ret = -EINVAL;
+					goto out;
+				}
+			}
+
+			if (serial)
+				break;
+		}
+	}
+
+	ret = 0;
+out:
+	kfree(digests);
+	kfree(msgs);
+	kfree(tmp);
+	kfree(desc);
+	crypto_free_shash(tfm);
+	return ret;
+}
+
 static int alg_test_hash(const struct alg_test_desc *desc, const char *driver,
 			 u32 type, u32 mask)
 {
@@ -1451,6 +1578,10 @@ static int alg_test_hash(const struct alg_test_desc *desc, const char *driver,
 	if (!err)
 		err = test_hash(tfm, desc->suite.hash.vecs,
 				desc->suite.hash.count, false);
+	if (!err)
+		err = test_hash_finup_mb(driver, type, mask,
+					 desc->suite.hash.vecs,
+					 desc->suite.hash.count);
 
 	crypto_free_ahash(tfm);
 	return err;
@@ -75,6 +75,8 @@
 #include <linux/kthread.h>
 #include <linux/splice.h>
 #include <linux/sysfs.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
 
 #include <asm/uaccess.h>
 
@@ -498,6 +500,490 @@ out:
 	return ret;
 }
 
+/*
+ * Direct I/O mode: the backing file's blocks are looked up once with
+ * bmap(), and IO to the loop device is remapped onto the device the
+ * file lives on.  No data goes through the backing file's page cache,
+ * and since the loop thread only maps and submits, any number of bios
+ * can be in flight.  Like a swap file, the backing file must be fully
+ * allocated and stay where it is while the mapping is in use, so it is
+ * marked S_SWAPFILE for as long, and only filesystems that overwrite
+ * file data in place are accepted.
+ */
+#define LOOP_DIO_POOL_SIZE	16
+#define LOOP_DIO_FIEMAP_BATCH	32
+
+/* Extents whose blocks do not simply hold the file's data */
+#define LOOP_DIO_BAD_EXTENT	(FIEMAP_EXTENT_UNKNOWN |		\
+				 FIEMAP_EXTENT_DELALLOC |		\
+				 FIEMAP_EXTENT_ENCODED |		\
+				 FIEMAP_EXTENT_DATA_ENCRYPTED |		\
+				 FIEMAP_EXTENT_NOT_ALIGNED |		\
+				 FIEMAP_EXTENT_DATA_INLINE |		\
+				 FIEMAP_EXTENT_DATA_TAIL |		\
+				 FIEMAP_EXTENT_UNWRITTEN |		\
+				 FIEMAP_EXTENT_SHARED)
+
+struct loop_extent {
+	sector_t		file_block;	/* first block in the file */
+	sector_t		disk_block;	/* where it is on the device */
+	sector_t		nr_blocks;
+};
+
+struct loop_dio_map {
+	struct block_device	*bdev;
+	struct inode		*pinned;	/* backing file we set S_SWAPFILE on */
+	unsigned int		blkbits;
+	unsigned int		nr_extents;
+	struct loop_extent	*extents;	/* sorted by file_block */
+
+	struct bio_set		*bio_set;
+	mempool_t		*dio_pool;
+};
+
+/* A loop bio, split into one or more bios to the backing device */
+struct loop_dio {
+	struct loop_device	*lo;
+	struct loop_dio_map	*map;
+	struct bio		*bio;
+	atomic_t		pending;
+	int			error;
+};
+
+static struct loop_extent *loop_dio_lookup(struct loop_dio_map *map,
+					   sector_t block)
+{
+	unsigned int left = 0, right = map->nr_extents;
+
+	while (left < right) {
+		unsigned int mid = (left + right) / 2;
+		struct loop_extent *ext = &map->extents[mid];
+
+		if (block < ext->file_block)
+			right = mid;
+		else if (block >= ext->file_block + ext->nr_blocks)
+			left = mid + 1;
+		else
+			return ext;
+	}
+
+	return NULL;
+}
+
+static void loop_dio_put(struct loop_dio *dio)
+{
+	struct loop_device *lo = dio->lo;
+
+	if (!atomic_dec_and_test(&dio->pending))
+		return;
+
+	bio_endio(dio->bio, dio->error);
+	mempool_free(dio, dio->map->dio_pool);
+
+	/* the map may be freed as soon as this drops to zero */
+	if (atomic_dec_and_test(&lo->lo_dio_inflight))
+		wake_up(&lo->lo_dio_wait);
+}
+
+static void loop_dio_end_io(struct bio *clone, int error)
+{
+	struct loop_dio *dio = clone->bi_private;
+
+	if (error)
+		dio->error = error;
+
+	bio_put(clone);
+	loop_dio_put(dio);
+}
+
+static struct bio *loop_dio_alloc(struct loop_dio *dio, sector_t sector,
+				  unsigned long rw, unsigned int nr_vecs)
+{
+	struct bio *clone;
+
+	clone = bio_alloc_bioset(GFP_NOIO, min_t(unsigned int, nr_vecs,
+						 BIO_MAX_PAGES),
+				 dio->map->bio_set);
+	clone->bi_bdev = dio->map->bdev;
+	clone->bi_sector = sector;
+	clone->bi_rw = rw;
+	clone->bi_end_io = loop_dio_end_io;
+	clone->bi_private = dio;
+
+	atomic_inc(&dio->pending);
+	return clone;
+}
+
+/*
+ * Called from the loop thread.  Walk the segments of @bio, cutting it
+ * where the backing file is not contiguous on disk or the backing
+ * queue is full, and send the pieces down without waiting for them.
+ * Every piece keeps the bio's REQ_FLUSH and REQ_FUA: the pieces may be
+ * written in any order, so each needs its own preflush to be sure the
+ * cache was emptied before any of the bio's data reached the disk.
+ */
+static void loop_dio_submit(struct loop_device *lo, struct bio *bio)
+{
+	struct loop_dio_map *map = lo->lo_dio;
+	unsigned int blkbits = map->blkbits;
+	loff_t blkmask = (1 << blkbits) - 1;
+	loff_t pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
+	unsigned long rw = bio->bi_rw;
+	struct bio *clone = NULL;
+	struct bio_vec *bvec;
+	struct loop_dio *dio;
+	struct blk_plug plug;
+	int i;
+
+	dio = mempool_alloc(map->dio_pool, GFP_NOIO);
+	dio->lo = lo;
+	dio->map = map;
+	dio->bio = bio;
+	dio->error = 0;
+	atomic_set(&dio->pending, 1);
+	atomic_inc(&lo->lo_dio_inflight);
+
+	blk_start_plug(&plug);
+
+	/* an empty flush just goes to the backing device */
+	if (!bio->bi_size) {
+		generic_make_request(loop_dio_alloc(dio, 0, rw, 0));
+		goto out;
+	}
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int offset = bvec->bv_offset;
+		unsigned int len = bvec->bv_len;
+
+		while (len) {
+			struct loop_extent *ext;
+			unsigned int chunk;
+			sector_t sector;
+			loff_t end;
+
+			ext = loop_dio_lookup(map, pos >> blkbits);
+			if (unlikely(!ext)) {
+				dio->error = -EIO;
+				goto out;
+			}
+
+			end = (loff_t) (ext->file_block + ext->nr_blocks) << blkbits;
+			chunk = min_t(loff_t, len, end - pos);
+			sector = ((ext->disk_block + (pos >> blkbits) -
+				   ext->file_block) << (blkbits - 9)) +
+				 ((pos & blkmask) >> 9);
+
+			if (!clone ||
+			    clone->bi_sector + bio_sectors(clone) != sector ||
+			    bio_add_page(clone, bvec->bv_page, chunk,
+					 offset) < chunk) {
+				if (clone)
+					generic_make_request(clone);
+
+				clone = loop_dio_alloc(dio, sector, rw,
+						       bio->bi_vcnt - i);
+				if (bio_add_page(clone, bvec->bv_page, chunk,
+						 offset) < chunk) {
+					bio_endio(clone, -EIO);
+					clone = NULL;
+					goto out;
+				}
+			}
+
+			pos += chunk;
+			offset += chunk;
+			len -= chunk;
+		}
+	}
+
+out:
+	if (clone)
+		generic_make_request(clone);
+	blk_finish_plug(&plug);
+	loop_dio_put(dio);
+}
+
+/*
+ * Walk the block map of @inode from @first to @last, merging blocks that
+ * are contiguous on disk.  Fills in at most @max extents if @ext is set.
+ * Returns the number of extents, or < 0 for a hole or a changed map.
+ */
+static int loop_dio_map_extents(struct inode *inode, sector_t first,
+				sector_t last, struct loop_extent *ext, int max)
+{
+	struct loop_extent cur = { 0, };
+	sector_t block;
+	int nr = 0;
+
+	for (block = first; block <= last; block++) {
+		sector_t disk = bmap(inode, block);
+
+		if (!disk)
+			return -EINVAL;
+
+		if (nr && disk == cur.disk_block + cur.nr_blocks) {
+			cur.nr_blocks++;
+		} else {
+			if (nr && ext)
+				ext[nr - 1] = cur;
+			if (ext && nr == max)
+				return -EBUSY;
+			cur.file_block = block;
+			cur.disk_block = disk;
+			cur.nr_blocks = 1;
+			nr++;
+		}
+
+		cond_resched();
+	}
+
+	if (nr && ext)
+		ext[nr - 1] = cur;
+	return nr;
+}
+
+/*
+ * bmap() also returns the blocks of unwritten (preallocated) extents,
+ * which read back as zeroes through the filesystem but hold stale data
+ * on disk.  Ask ->fiemap about the byte range [@start, @end) and refuse
+ * it unless all of it lies in ordinary written extents.
+ */
+static int loop_dio_check_extents(struct inode *inode, u64 start, u64 end)
+{
+	struct fiemap_extent_info fieinfo = { 0, };
+	struct fiemap_extent *fe;
+	mm_segment_t old_fs;
+	unsigned int i;
+	int err = 0;
+
+	fe = kmalloc(LOOP_DIO_FIEMAP_BATCH * sizeof(*fe), GFP_KERNEL);
+	if (!fe)
+		return -ENOMEM;
+
+	while (start < end) {
+		fieinfo.fi_extents_mapped = 0;
+		fieinfo.fi_extents_max = LOOP_DIO_FIEMAP_BATCH;
+		fieinfo.fi_extents_start = (struct fiemap_extent __user *)fe;
+
+		/* fiemap copies the extents out as if to userspace */
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		err = inode->i_op->fiemap(inode, &fieinfo, start, end - start);
+		set_fs(old_fs);
+		if (err)
+			break;
+
+		err = -EINVAL;
+		if (!fieinfo.fi_extents_mapped)
+			break;
+
+		for (i = 0; i < fieinfo.fi_extents_mapped && start < end; i++) {
+			if (fe[i].fe_logical > start || !fe[i].fe_length ||
+			    (fe[i].fe_flags & LOOP_DIO_BAD_EXTENT))
+				goto out;
+			start = fe[i].fe_logical + fe[i].fe_length;
+		}
+
+		if (start < end && (fe[i - 1].fe_flags & FIEMAP_EXTENT_LAST))
+			break;
+		err = 0;
+	}
+out:
+	kfree(fe);
+	return err;
+}
+
+/* XFS_IOC_FSGETXATTR and XFS_XFLAG_REALTIME, from the XFS ioctl ABI */
+struct loop_fsxattr {
+	__u32		fsx_xflags;
+	__u32		fsx_extsize;
+	__u32		fsx_nextents;
+	__u32		fsx_projid;
+	unsigned char	fsx_pad[12];
+};
+#define LOOP_XFS_IOC_FSGETXATTR	_IOR('X', 31, struct loop_fsxattr)
+#define LOOP_XFS_XFLAG_REALTIME	0x00000001
+
+static long loop_file_ioctl(struct file *file, unsigned int cmd, void *arg)
+{
+	mm_segment_t old_fs;
+	long err;
+
+	if (!file->f_op || !file->f_op->unlocked_ioctl)
+		return -ENOTTY;
+
+	/* the filesystem copies its answer out as if to userspace */
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	err = file->f_op->unlocked_ioctl(file, cmd, (unsigned long)arg);
+	set_fs(old_fs);
+	return err;
+}
+
+/*
+ * Only files whose data blocks stay put when overwritten, and whose
+ * blocks are on i_sb->s_bdev, can be remapped:
+ *  - the filesystem must be one known to overwrite in place;
+ *  - data journaling, mount wide or per inode, would replay stale data
+ *    over our writes after a crash.  ext3 and ext4 give such files an
+ *    address space without ->direct_IO; the inode flag is checked too;
+ *  - an XFS realtime file lives on the realtime device.
+ */
+static bool loop_dio_file_ok(struct file *file)
+{
+	static const char * const names[] = { "ext2", "ext3", "ext4", "xfs" };
+	struct inode *inode = file->f_mapping->host;
+	const char *name = inode->i_sb->s_type->name;
+	struct loop_fsxattr fsx;
+	int flags, i;
+
+	for (i = 0; i < ARRAY_SIZE(names); i++)
+		if (!strcmp(name, names[i]))
+			break;
+	if (i == ARRAY_SIZE(names))
+		return false;
+
+	if (!file->f_mapping->a_ops->direct_IO)
+		return false;
+
+	if (loop_file_ioctl(file, FS_IOC_GETFLAGS, &flags) ||
+	    (flags & FS_JOURNAL_DATA_FL))
+		return false;
+
+	if (!strcmp(name, "xfs") &&
+	    (loop_file_ioctl(file, LOOP_XFS_IOC_FSGETXATTR, &fsx) ||
+	     (fsx.fsx_xflags & LOOP_XFS_XFLAG_REALTIME)))
+		return false;
+
+	return true;
+}
+
+/* Keep the backing file from being truncated, as swapon does */
+static int loop_dio_pin(struct loop_dio_map *map, struct inode *inode)
+{
+	int err = 0;
+
+	mutex_lock(&inode->i_mutex);
+	if (IS_SWAPFILE(inode))
+		err = -EBUSY;
+	else
+		inode->i_flags |= S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+
+	if (!err)
+		map->pinned = inode;
+	return err;
+}
+
+static void loop_dio_map_free(struct loop_device *lo, struct loop_dio_map *map)
+{
+	/* wait for the bios still using the map's pools */
+	wait_event(lo->lo_dio_wait, !atomic_read(&lo->lo_dio_inflight));
+
+	if (map->pinned) {
+		mutex_lock(&map->pinned->i_mutex);
+		map->pinned->i_flags &= ~S_SWAPFILE;
+		mutex_unlock(&map->pinned->i_mutex);
+	}
+
+	if (map->dio_pool)
+		mempool_destroy(map->dio_pool);
+	if (map->bio_set)
+		bioset_free(map->bio_set);
+	vfree(map->extents);
+	kfree(map);
+}
+
+static struct loop_dio_map *loop_dio_map_create(struct loop_device *lo)
+{
+	struct file *file = lo->lo_backing_file;
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	loff_t size = (loff_t) get_capacity(lo->lo_disk) << 9;
+	struct loop_dio_map *map;
+	sector_t first, last;
+	int nr, err;
+
+	/* data must reach the device unchanged and sector aligned */
+	if (lo->lo_encryption || (lo->lo_offset & 511) || !size)
+		return ERR_PTR(-EINVAL);
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return ERR_PTR(-ENOMEM);
+
+	if (S_ISBLK(inode->i_mode)) {
+		map->bdev = I_BDEV(inode);
+		map->blkbits = 9;
+	} else {
+		map->bdev = inode->i_sb->s_bdev;
+		map->blkbits = inode->i_blkbits;
+		err = -EINVAL;
+		if (!map->bdev || !mapping->a_ops->bmap ||
+		    !inode->i_op->fiemap || !loop_dio_file_ok(file))
+			goto out_free;
+
+		err = loop_dio_pin(map, inode);
+		if (err)
+			goto out_free;
+	}
+
+	err = -EINVAL;
+	if (bdev_logical_block_size(map->bdev) > 512)
+		goto out_free;
+
+	/* get blocks under delayed allocation allocated */
+	err = filemap_write_and_wait(mapping);
+	if (err)
+		goto out_free;
+
+	first = lo->lo_offset >> map->blkbits;
+	last = (lo->lo_offset + size - 1) >> map->blkbits;
+
+	if (S_ISBLK(inode->i_mode)) {
+		nr = 1;
+	} else {
+		err = loop_dio_check_extents(inode, lo->lo_offset,
+					     lo->lo_offset + size);
+		if (err)
+			goto out_free;
+		nr = loop_dio_map_extents(inode, first, last, NULL, 0);
+	}
+	err = nr;
+	if (nr < 0)
+		goto out_free;
+
+	err = -ENOMEM;
+	map->extents = vmalloc(nr * sizeof(struct loop_extent));
+	if (!map->extents)
+		goto out_free;
+
+	if (S_ISBLK(inode->i_mode)) {
+		map->extents[0].file_block = first;
+		map->extents[0].disk_block = first;
+		map->extents[0].nr_blocks = last - first + 1;
+	} else {
+		nr = loop_dio_map_extents(inode, first, last, map->extents, nr);
+		err = nr;
+		if (nr < 0)
+			goto out_free;
+	}
+	map->nr_extents = nr;
+
+	err = -ENOMEM;
+	map->bio_set = bioset_create(LOOP_DIO_POOL_SIZE, 0);
+	map->dio_pool = mempool_create_kmalloc_pool(LOOP_DIO_POOL_SIZE,
+						    sizeof(struct loop_dio));
+	if (!map->bio_set || !map->dio_pool)
+		goto out_free;
+
+	return map;
+
+out_free:
+	loop_dio_map_free(lo, map);
+	return ERR_PTR(err);
+}
+
 /*
  * Add bio to back of pending list
  */
@@ -553,6 +1039,8 @@ static void loop_unplug(struct request_queue *q)
 
 struct switch_request {
 	struct file *file;
+	bool set_dio;
+	struct loop_dio_map *dio;	/* new map in, old map out */
 	struct completion wait;
 };
 
@@ -563,6 +1051,8 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 	if (unlikely(!bio->bi_bdev)) {
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
+	} else if (lo->lo_dio) {
+		loop_dio_submit(lo, bio);
 	} else {
 		int ret = do_bio_filebacked(lo, bio);
 		bio_endio(bio, ret);
@@ -612,21 +1102,26 @@ static int loop_thread(void *data)
  * First it needs to flush existing IO, it does this by sending a magic
  * BIO down the pipe. The completion of this BIO does the actual switch.
  */
-static int loop_switch(struct loop_device *lo, struct file *file)
+static int __loop_switch(struct loop_device *lo, struct switch_request *w)
 {
-	struct switch_request w;
 	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
 	if (!bio)
 		return -ENOMEM;
-	init_completion(&w.wait);
-	w.file = file;
-	bio->bi_private = &w;
+	init_completion(&w->wait);
+	bio->bi_private = w;
 	bio->bi_bdev = NULL;
 	loop_make_request(lo->lo_queue, bio);
-	wait_for_completion(&w.wait);
+	wait_for_completion(&w->wait);
 	return 0;
 }
 
+static int loop_switch(struct loop_device *lo, struct file *file)
+{
+	struct switch_request w = { .file = file, };
+
+	return __loop_switch(lo, &w);
+}
+
 /*
  * Helper to flush the IOs in loop, but keeping loop thread running
  */
@@ -648,6 +1143,23 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 	struct file *old_file = lo->lo_backing_file;
 	struct address_space *mapping;
 
+	if (p->set_dio) {
+		struct loop_dio_map *map = p->dio;
+
+		/*
+		 * Write back and drop the backing page cache either way.
+		 * Turning direct I/O on, bios ahead of us went through it;
+		 * turning it off, it may hold pages that direct I/O has
+		 * since overwritten on disk.
+		 */
+		mapping = old_file->f_mapping;
+		filemap_write_and_wait(mapping);
+		invalidate_inode_pages2(mapping);
+		p->dio = lo->lo_dio;
+		lo->lo_dio = map;
+		goto out;
+	}
+
 	/* if no new file, only flush of queued bios requested */
 	if (!file)
 		goto out;
@@ -688,6 +1200,11 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	if (!(lo->lo_flags & LO_FLAGS_READ_ONLY))
 		goto out;
 
+	/* the direct I/O map belongs to the old file */
+	error = -EBUSY;
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		goto out;
+
 	error = -EBADF;
 	file = fget(arg);
 	if (!file)
@@ -721,6 +1238,45 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	return error;
 }
 
+/*
+ * Switch direct I/O to the backing device on or off.  The loop thread
+ * picks up the new map in order with the bios queued before it, and
+ * the old map is freed once the IO it mapped has completed.
+ */
+static int loop_set_dio(struct loop_device *lo, unsigned long arg)
+{
+	struct switch_request w = { .set_dio = true, };
+	int error;
+
+	if (lo->lo_state != Lo_bound)
+		return -ENXIO;
+
+	if (!arg == !(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return 0;
+
+	if (arg) {
+		w.dio = loop_dio_map_create(lo);
+		if (IS_ERR(w.dio))
+			return PTR_ERR(w.dio);
+	}
+
+	error = __loop_switch(lo, &w);
+	if (error) {
+		if (w.dio)
+			loop_dio_map_free(lo, w.dio);
+		return error;
+	}
+
+	if (arg)
+		lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+	else
+		lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+
+	if (w.dio)
+		loop_dio_map_free(lo, w.dio);
+	return 0;
+}
+
 static inline int is_loop_device(struct file *file)
 {
 	struct inode *i = file->f_mapping->host;
@@ -795,16 +1351,25 @@ static ssize_t loop_attr_autoclear_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", autoclear ? "1" : "0");
 }
 
+static ssize_t loop_attr_dio_show(struct loop_device *lo, char *buf)
+{
+	int dio = (lo->lo_flags & LO_FLAGS_DIRECT_IO);
+
+	return sprintf(buf, "%s\n", dio ? "1" : "0");
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
+LOOP_ATTR_RO(dio);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
 	&loop_attr_offset.attr,
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
+	&loop_attr_dio.attr,
 	NULL,
 };
 
@@ -1019,6 +1584,11 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 
 	kthread_stop(lo->lo_thread);
 
+	if (lo->lo_dio) {
+		loop_dio_map_free(lo, lo->lo_dio);
+		lo->lo_dio = NULL;
+	}
+
 	lo->lo_queue->unplug_fn = NULL;
 	lo->lo_backing_file = NULL;
 
@@ -1077,6 +1647,13 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
 
+	/* the direct I/O map is for this offset and size, unencrypted */
+	if ((lo->lo_flags & LO_FLAGS_DIRECT_IO) &&
+	    (info->lo_encrypt_type ||
+	     lo->lo_offset != info->lo_offset ||
+	     lo->lo_sizelimit != info->lo_sizelimit))
+		return -EBUSY;
+
 	err = loop_release_xfer(lo);
 	if (err)
 		return err;
@@ -1278,6 +1855,9 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	err = -ENXIO;
 	if (unlikely(lo->lo_state != Lo_bound))
 		goto out;
+	err = -EBUSY;
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		goto out;
 	err = figure_loop_size(lo);
 	if (unlikely(err))
 		goto out;
@@ -1332,6 +1912,11 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
 			err = loop_set_capacity(lo, bdev);
 		break;
+	case LOOP_SET_DIRECT_IO:
+		err = -EPERM;
+		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
+			err = loop_set_dio(lo, arg);
+		break;
 	default:
 		err = lo->ioctl ? lo->ioctl(lo, cmd, arg) : -EINVAL;
 	}
@@ -1486,6 +2071,7 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 		arg = (unsigned long) compat_ptr(arg);
 	case LOOP_SET_FD:
 	case LOOP_CHANGE_FD:
+	case LOOP_SET_DIRECT_IO:
 		err = lo_ioctl(bdev, mode, cmd, arg);
 		break;
 	default:
@@ -1617,6 +2203,7 @@ static struct loop_device *loop_alloc(int i)
 	lo->lo_number		= i;
 	lo->lo_thread		= NULL;
 	init_waitqueue_head(&lo->lo_event);
+	init_waitqueue_head(&lo->lo_dio_wait);
 	spin_lock_init(&lo->lo_lock);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
@@ -9,6 +9,7 @@
 
 #include <asm/atomic.h>
 #include <asm/page.h>
+#include <linux/bio.h>  /* struct bio_vec */
 #include <linux/bitops.h>  /* for fls() */
 #include <linux/bug.h>
 #include <linux/cpumask.h>  /* nr_cpu_ids */
@@ -21,6 +22,7 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/mm_types.h>
+#include <linux/sched.h>  /* cond_resched() */
 #include <linux/scatterlist.h>
 #include <linux/slab.h>  /* k*alloc */
 #include <linux/string.h>  /* memset */
@@ -95,27 +97,34 @@ typedef int (*dm_bht_compare_cb)(struct dm_bht *, u8 *, u8 *);
 
 /**
  * dm_bht_compute_hash: hashes a page of data
+ *
+ * Callers may run on any CPU concurrently; preemption is held off while the
+ * CPU's hash_desc is in use so that it is never shared.
  */
 static int dm_bht_compute_hash(struct dm_bht *bht, struct page *pg,
 			       unsigned int offset, u8 *digest)
 {
-	struct hash_desc *hash_desc = &bht->hash_desc[smp_processor_id()];
+	int cpu = get_cpu();
+	struct hash_desc *hash_desc = &bht->hash_desc[cpu];
 	struct scatterlist sg;
+	int r = 0;
 
 	sg_init_table(&sg, 1);
 	sg_set_page(&sg, pg, PAGE_SIZE, offset);
 	/* Note, this is synchronous. */
 	if (crypto_hash_init(hash_desc)) {
-		DMCRIT("failed to reinitialize crypto hash (proc:%d)",
-			smp_processor_id());
-		return -EINVAL;
+		DMCRIT("failed to reinitialize crypto hash (proc:%d)", cpu);
+		r = -EINVAL;
+		goto out;
 	}
 	if (crypto_hash_digest(hash_desc, &sg, PAGE_SIZE, digest)) {
 		DMCRIT("crypto_hash_digest failed");
-		return -EINVAL;
+		r = -EINVAL;
 	}
 
-	return 0;
+out:
+	put_cpu();
+	return r;
 }
 
 static __always_inline struct dm_bht_level *dm_bht_get_level(struct dm_bht *bht,
@@ -818,6 +827,79 @@ int dm_bht_verify_block(struct dm_bht *bht, unsigned int block,
 }
 EXPORT_SYMBOL(dm_bht_verify_block);
 
+/**
+ * dm_bht_verify_range - checks a run of contiguous blocks in one pass
+ * @bht:	pointer to a dm_bht_create()d bht
+ * @block:	first block of the run
+ * @bvec:	@count page-sized bio_vecs holding the data for each block
+ * @count:	number of blocks in the run
+ *
+ * Returns 0 on success, 1 on missing data, and a negative error code on
+ * verification failure, like dm_bht_verify_block().
+ *
+ * Blocks whose digests live in the same entry are handled together: the
+ * path from that entry to the root is checked once, with the first block,
+ * and the rest of the run is then only hashed and compared against the
+ * loaded entry.  The CPU's hash_desc and scatterlist are set up once per
+ * entry rather than once per block.
+ */
+int dm_bht_verify_range(struct dm_bht *bht, unsigned int block,
+			struct bio_vec *bvec, unsigned int count)
+{
+	int depth = bht->depth - 1;
+
+	while (count) {
+		struct dm_bht_entry *entry = dm_bht_get_entry(bht, depth, block);
+		unsigned int run = min(count, bht->node_count -
+					      (block % bht->node_count));
+		struct hash_desc *hash_desc;
+		struct scatterlist sg;
+		u8 digest[DM_BHT_MAX_DIGEST_SIZE];
+		int r;
+
+		BUG_ON(bvec->bv_offset != 0);
+		if (atomic_read(&entry->state) != DM_BHT_ENTRY_VERIFIED) {
+			r = dm_bht_verify_path(bht, block, bvec->bv_page, 0);
+			if (r)
+				return r;
+			block++;
+			bvec++;
+			count--;
+			run--;
+		}
+
+		count -= run;
+		sg_init_table(&sg, 1);
+		hash_desc = &bht->hash_desc[get_cpu()];
+		for (; run; run--, block++, bvec++) {
+			u8 *node = dm_bht_get_node(bht, entry, depth + 1, block);
+
+			BUG_ON(bvec->bv_offset != 0);
+			sg_set_page(&sg, bvec->bv_page, PAGE_SIZE, 0);
+			if (crypto_hash_digest(hash_desc, &sg, PAGE_SIZE,
+					       digest)) {
+				put_cpu();
+				DMCRIT("crypto_hash_digest failed");
+				return -EINVAL;
+			}
+			if (memcmp(digest, node, bht->digest_size)) {
+				put_cpu();
+				DMERR_LIMIT("verify_range: failed to verify "
+					    "hash (bi=%u)", block);
+				dm_bht_log_mismatch(bht, node, digest);
+				return DM_BHT_ENTRY_ERROR_MISMATCH;
+			}
+		}
+		put_cpu();
+
+		/* Allow a reschedule between entries. */
+		cond_resched();
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL(dm_bht_verify_range);
+
 /**
  * dm_bht_destroy - cleans up all memory used by @bht
  * @bht:	pointer to a dm_bht_create()d bht
@@ -19,6 +19,7 @@
 #include <linux/workqueue.h>
 #include <linux/backing-dev.h>
 #include <linux/percpu.h>
+#include <linux/cpumask.h>
 #include <asm/atomic.h>
 #include <linux/scatterlist.h>
 #include <asm/page.h>
@@ -32,6 +33,8 @@
 #define DM_MSG_PREFIX "crypt"
 #define MESG_STR(x) x, sizeof(x)
 
+struct dm_crypt_io;
+
 /*
  * context holding the current state of a multi-part conversion
  */
@@ -44,7 +47,10 @@ struct convert_context {
 	unsigned int idx_in;
 	unsigned int idx_out;
 	sector_t sector;
+	sector_t end_sector;
 	atomic_t pending;
+	int error;
+	struct dm_crypt_io *io;
 };
 
 /*
@@ -63,6 +69,17 @@ struct dm_crypt_io {
 	struct dm_crypt_io *base_io;
 };
 
+/*
+ * Part of a conversion handed to another CPU.  The slices of one
+ * conversion each hold a reference on the pending count of the io's own
+ * context, so the io completes once the last of them is done, whatever
+ * order they finish in.
+ */
+struct dm_crypt_slice {
+	struct work_struct work;
+	struct convert_context ctx;
+};
+
 struct dm_crypt_request {
 	struct convert_context *ctx;
 	struct scatterlist sg_in;
@@ -110,6 +127,17 @@ enum flags { DM_CRYPT_SUSPENDED, DM_CRYPT_KEY_VALID };
  */
 struct crypt_cpu {
 	struct ablkcipher_request *req;
+	/* CPU the last write submitted from this CPU was encrypted on */
+	int write_cpu;
+
+	/* recycled bounce pages, see crypt_page_alloc() */
+	spinlock_t page_lock;
+	struct list_head pages;
+	unsigned int nr_pages;
+	unsigned long page_hits;
+	unsigned long page_allocs;
+	unsigned long page_stalls;
+
 	/* ESSIV: struct crypto_cipher *essiv_tfm */
 	void *iv_private;
 	struct crypto_ablkcipher *tfms[0];
@@ -130,10 +158,18 @@ struct crypt_config {
 	mempool_t *io_pool;
 	mempool_t *req_pool;
 	mempool_t *page_pool;
+	mempool_t *slice_pool;
+
+	struct shrinker page_shrinker;
 	struct bio_set *bs;
 
 	struct workqueue_struct *io_queue;
 	struct workqueue_struct *crypt_queue;
+	/*
+	 * Slices get their own queue: write works on crypt_queue may sleep
+	 * on page_pool until a clone completes, which needs its slices.
+	 */
+	struct workqueue_struct *slice_queue;
 
 	char *cipher;
 	char *cipher_string;
@@ -180,6 +216,33 @@ struct crypt_config {
 #define MIN_BIO_PAGES  8
 
 static struct kmem_cache *_crypt_io_pool;
+static struct kmem_cache *_crypt_slice_pool;
+
+/*
+ * Bounds how many CPUs the encryption of a single bio is spread across.
+ * 0 uses every online CPU; 1 keeps each bio on one CPU and leaves writes
+ * on the submitting CPU (the historical behavior).
+ */
+static unsigned int crypt_cpus;
+module_param(crypt_cpus, uint, 0644);
+MODULE_PARM_DESC(crypt_cpus, "Max CPUs used to encrypt one bio "
+			     "(0 = all online)");
+
+/*
+ * Smallest number of sectors handed to a single encryption worker.
+ * Anything smaller is not worth the cross-CPU wakeup.
+ */
+static unsigned int crypt_batch = 128;
+module_param(crypt_batch, uint, 0644);
+MODULE_PARM_DESC(crypt_batch, "Min sectors encrypted per worker");
+
+/*
+ * Number of bounce pages each CPU keeps for reuse once a write
+ * completes, instead of handing them back to the page allocator.
+ */
+static unsigned int crypt_page_cache = 256;
+module_param(crypt_page_cache, uint, 0644);
+MODULE_PARM_DESC(crypt_page_cache, "Bounce pages recycled per CPU");
 
 static void clone_init(struct dm_crypt_io *, struct bio *);
 static void kcryptd_queue_crypt(struct dm_crypt_io *io);
@@ -667,9 +730,43 @@ static void crypt_convert_init(struct crypt_config *cc,
 	ctx->idx_in = bio_in ? bio_in->bi_idx : 0;
 	ctx->idx_out = bio_out ? bio_out->bi_idx : 0;
 	ctx->sector = sector + cc->iv_offset;
+	ctx->end_sector = (sector_t)-1;
+	ctx->error = 0;
 	init_completion(&ctx->restart);
 }
 
+/*
+ * Moves the conversion on by @sectors without converting them.
+ */
+static void crypt_convert_advance(struct convert_context *ctx,
+				  unsigned int sectors)
+{
+	unsigned int left, n;
+	struct bio_vec *bv;
+
+	ctx->sector += sectors;
+
+	for (left = sectors; left; left -= n) {
+		bv = bio_iovec_idx(ctx->bio_in, ctx->idx_in);
+		n = min(left, (bv->bv_len - ctx->offset_in) >> SECTOR_SHIFT);
+		ctx->offset_in += n << SECTOR_SHIFT;
+		if (ctx->offset_in >= bv->bv_len) {
+			ctx->offset_in = 0;
+			ctx->idx_in++;
+		}
+	}
+
+	for (left = sectors; left; left -= n) {
+		bv = bio_iovec_idx(ctx->bio_out, ctx->idx_out);
+		n = min(left, (bv->bv_len - ctx->offset_out) >> SECTOR_SHIFT);
+		ctx->offset_out += n << SECTOR_SHIFT;
+		if (ctx->offset_out >= bv->bv_len) {
+			ctx->offset_out = 0;
+			ctx->idx_out++;
+		}
+	}
+}
+
 static struct dm_crypt_request *dmreq_of_req(struct crypt_config *cc,
 					     struct ablkcipher_request *req)
 {
@@ -764,6 +861,7 @@ static void crypt_alloc_req(struct crypt_config *cc,
 
 /*
  * Encrypt / decrypt data from one bio to another one (can be the same one)
+ * up to ctx->end_sector.  The caller holds a reference on ctx->pending.
  */
 static int crypt_convert(struct crypt_config *cc,
 			 struct convert_context *ctx)
@@ -771,10 +869,9 @@ static int crypt_convert(struct crypt_config *cc,
 	struct crypt_cpu *this_cc = this_crypt_config(cc);
 	int r;
 
-	atomic_set(&ctx->pending, 1);
-
 	while(ctx->idx_in < ctx->bio_in->bi_vcnt &&
-	      ctx->idx_out < ctx->bio_out->bi_vcnt) {
+	      ctx->idx_out < ctx->bio_out->bi_vcnt &&
+	      ctx->sector < ctx->end_sector) {
 
 		crypt_alloc_req(cc, ctx);
 
@@ -810,6 +907,80 @@ static int crypt_convert(struct crypt_config *cc,
 	return 0;
 }
 
+/*
+ * Records the first error of a conversion, whichever CPU hits it.
+ */
+static void crypt_convert_error(struct convert_context *ctx, int error)
+{
+	if (unlikely(error < 0))
+		cmpxchg(&ctx->error, 0, error);
+}
+
+static unsigned int crypt_cpus_used(void)
+{
+	unsigned int cpus = num_online_cpus();
+
+	if (crypt_cpus && crypt_cpus < cpus)
+		return crypt_cpus;
+
+	return cpus;
+}
+
+static int crypt_next_cpu(int cpu)
+{
+	cpu = cpumask_next(cpu, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+
+	return cpu;
+}
+
+static void kcryptd_crypt_slice(struct work_struct *work);
+
+/*
+ * Converts the next @sectors sectors of io->ctx, handing leading chunks
+ * of at least crypt_batch sectors to other CPUs and converting the last
+ * one here.  That leaves io->ctx positioned at the end of the range, as
+ * a plain crypt_convert() would.  Every slice holds a reference on
+ * io->ctx.pending; the caller drops its own once this returns.
+ */
+static int crypt_convert_split(struct crypt_config *cc,
+			       struct dm_crypt_io *io, unsigned int sectors)
+{
+	struct convert_context *ctx = &io->ctx;
+	struct dm_crypt_slice *slice;
+	unsigned int cpus = crypt_cpus_used();
+	unsigned int per_cpu;
+	int cpu = raw_smp_processor_id();
+
+	atomic_set(&ctx->pending, 1);
+
+	per_cpu = max_t(unsigned int, DIV_ROUND_UP(sectors, cpus),
+			max_t(unsigned int, crypt_batch, 1));
+
+	while (cpus > 1 && sectors > per_cpu) {
+		slice = mempool_alloc(cc->slice_pool, GFP_NOWAIT);
+		if (!slice)
+			break;
+
+		slice->ctx = *ctx;
+		init_completion(&slice->ctx.restart);
+		atomic_set(&slice->ctx.pending, 1);
+		slice->ctx.error = 0;
+		slice->ctx.end_sector = ctx->sector + per_cpu;
+
+		crypt_convert_advance(ctx, per_cpu);
+		sectors -= per_cpu;
+		atomic_inc(&ctx->pending);
+
+		cpu = crypt_next_cpu(cpu);
+		INIT_WORK(&slice->work, kcryptd_crypt_slice);
+		queue_work_on(cpu, cc->slice_queue, &slice->work);
+	}
+
+	return crypt_convert(cc, ctx);
+}
+
 static void dm_crypt_bio_destructor(struct bio *bio)
 {
 	struct dm_crypt_io *io = bio->bi_private;
@@ -818,6 +989,119 @@ static void dm_crypt_bio_destructor(struct bio *bio)
 	bio_free(bio, cc->bs);
 }
 
+/*
+ * Bounce pages come from the local CPU's recycled list first, then from
+ * the page allocator on the local node, and only then from the reserve
+ * in cc->page_pool, which may sleep.  The last case is counted as a
+ * stall.
+ */
+static struct page *crypt_page_alloc(struct crypt_config *cc, gfp_t gfp_mask)
+{
+	struct crypt_cpu *this_cc;
+	struct page *page = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	this_cc = this_crypt_config(cc);
+	spin_lock(&this_cc->page_lock);
+	if (!list_empty(&this_cc->pages)) {
+		page = list_first_entry(&this_cc->pages, struct page, lru);
+		list_del(&page->lru);
+		this_cc->nr_pages--;
+		this_cc->page_hits++;
+	}
+	spin_unlock(&this_cc->page_lock);
+	local_irq_restore(flags);
+
+	if (page)
+		return page;
+
+	page = alloc_pages_node(numa_node_id(),
+				(gfp_mask | __GFP_NOWARN | __GFP_NOMEMALLOC) &
+				~__GFP_WAIT, 0);
+	if (page) {
+		this_cpu_inc(cc->cpu->page_allocs);
+		return page;
+	}
+
+	this_cpu_inc(cc->cpu->page_stalls);
+	return mempool_alloc(cc->page_pool, gfp_mask);
+}
+
+static void crypt_page_free(struct crypt_config *cc, struct page *page)
+{
+	struct crypt_cpu *this_cc;
+	unsigned long flags;
+
+	/* Keep the reserve full before caching anything. */
+	if (cc->page_pool->curr_nr < cc->page_pool->min_nr ||
+	    page_to_nid(page) != numa_node_id()) {
+		mempool_free(page, cc->page_pool);
+		return;
+	}
+
+	local_irq_save(flags);
+	this_cc = this_crypt_config(cc);
+	spin_lock(&this_cc->page_lock);
+	if (this_cc->nr_pages < crypt_page_cache) {
+		list_add(&page->lru, &this_cc->pages);
+		this_cc->nr_pages++;
+		page = NULL;
+	}
+	spin_unlock(&this_cc->page_lock);
+	local_irq_restore(flags);
+
+	if (page)
+		mempool_free(page, cc->page_pool);
+}
+
+/*
+ * Returns up to @nr_to_scan recycled pages of @cpu to the page allocator.
+ */
+static unsigned int crypt_page_drain(struct crypt_config *cc, int cpu,
+				     unsigned int nr_to_scan)
+{
+	struct crypt_cpu *cpu_cc = per_cpu_ptr(cc->cpu, cpu);
+	struct page *page, *tmp;
+	unsigned long flags;
+	unsigned int freed = 0;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&cpu_cc->page_lock, flags);
+	list_for_each_entry_safe(page, tmp, &cpu_cc->pages, lru) {
+		if (freed == nr_to_scan)
+			break;
+		list_move(&page->lru, &list);
+		cpu_cc->nr_pages--;
+		freed++;
+	}
+	spin_unlock_irqrestore(&cpu_cc->page_lock, flags);
+
+	list_for_each_entry_safe(page, tmp, &list, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+
+	return freed;
+}
+
+static int crypt_page_shrink(struct shrinker *shrink, int nr_to_scan,
+			     gfp_t gfp_mask)
+{
+	struct crypt_config *cc = container_of(shrink, struct crypt_config,
+					       page_shrinker);
+	unsigned long count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (nr_to_scan > 0)
+			nr_to_scan -= crypt_page_drain(cc, cpu, nr_to_scan);
+		count += per_cpu_ptr(cc->cpu, cpu)->nr_pages;
+	}
+
+	return min_t(unsigned long, count, INT_MAX);
+}
+
 /*
  * Generate a new unfragmented bio with the given size
  * This should never violate the device limitations
@@ -842,7 +1126,7 @@ static struct bio *crypt_alloc_buffer(struct dm_crypt_io *io, unsigned size,
 	*out_of_pages = 0;
 
 	for (i = 0; i < nr_iovecs; i++) {
-		page = mempool_alloc(cc->page_pool, gfp_mask);
+		page = crypt_page_alloc(cc, gfp_mask);
 		if (!page) {
 			*out_of_pages = 1;
 			break;
@@ -859,7 +1143,7 @@ static struct bio *crypt_alloc_buffer(struct dm_crypt_io *io, unsigned size,
 		len = (size > PAGE_SIZE) ? PAGE_SIZE : size;
 
 		if (!bio_add_page(clone, page, len, 0)) {
-			mempool_free(page, cc->page_pool);
+			crypt_page_free(cc, page);
 			break;
 		}
 
@@ -882,7 +1166,7 @@ static void crypt_free_buffer_pages(struct crypt_config *cc, struct bio *clone)
 	for (i = 0; i < clone->bi_vcnt; i++) {
 		bv = bio_iovec_idx(clone, i);
 		BUG_ON(!bv->bv_page);
-		mempool_free(bv->bv_page, cc->page_pool);
+		crypt_page_free(cc, bv->bv_page);
 		bv->bv_page = NULL;
 	}
 }
@@ -899,6 +1183,7 @@ static struct dm_crypt_io *crypt_io_alloc(struct dm_target *ti,
 	io->sector = sector;
 	io->error = 0;
 	io->base_io = NULL;
+	io->ctx.io = io;
 	atomic_set(&io->pending, 0);
 
 	return io;
@@ -1114,11 +1399,13 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 		sector += bio_sectors(clone);
 
 		crypt_inc_pending(io);
-		r = crypt_convert(cc, &io->ctx);
+		r = crypt_convert_split(cc, io, bio_sectors(clone));
+		crypt_convert_error(&io->ctx, r);
 		crypt_finished = atomic_dec_and_test(&io->ctx.pending);
 
 		/* Encryption was already finished, submit io now */
 		if (crypt_finished) {
+			r = io->ctx.error;
 			kcryptd_crypt_write_io_submit(io, r, 0);
 
 			/*
@@ -1188,20 +1475,56 @@ static void kcryptd_crypt_read_convert(struct dm_crypt_io *io)
 	crypt_convert_init(cc, &io->ctx, io->base_bio, io->base_bio,
 			   io->sector);
 
-	r = crypt_convert(cc, &io->ctx);
+	r = crypt_convert_split(cc, io, bio_sectors(io->base_bio));
+	crypt_convert_error(&io->ctx, r);
 
 	if (atomic_dec_and_test(&io->ctx.pending))
-		kcryptd_crypt_read_done(io, r);
+		kcryptd_crypt_read_done(io, io->ctx.error);
 
 	crypt_dec_pending(io);
 }
 
+/*
+ * Called once every part of io->ctx has been converted.
+ */
+static void kcryptd_crypt_done(struct dm_crypt_io *io, int error, int async)
+{
+	if (bio_data_dir(io->base_bio) == READ)
+		kcryptd_crypt_read_done(io, error);
+	else
+		kcryptd_crypt_write_io_submit(io, error, async);
+}
+
+static void crypt_slice_done(struct dm_crypt_slice *slice)
+{
+	struct dm_crypt_io *io = slice->ctx.io;
+	struct crypt_config *cc = io->target->private;
+
+	crypt_convert_error(&io->ctx, slice->ctx.error);
+	mempool_free(slice, cc->slice_pool);
+
+	if (atomic_dec_and_test(&io->ctx.pending))
+		kcryptd_crypt_done(io, io->ctx.error, 1);
+}
+
+static void kcryptd_crypt_slice(struct work_struct *work)
+{
+	struct dm_crypt_slice *slice = container_of(work, struct dm_crypt_slice,
+						    work);
+	struct crypt_config *cc = slice->ctx.io->target->private;
+
+	crypt_convert_error(&slice->ctx, crypt_convert(cc, &slice->ctx));
+
+	if (atomic_dec_and_test(&slice->ctx.pending))
+		crypt_slice_done(slice);
+}
+
 static void kcryptd_async_done(struct crypto_async_request *async_req,
 			       int error)
 {
 	struct dm_crypt_request *dmreq = async_req->data;
 	struct convert_context *ctx = dmreq->ctx;
-	struct dm_crypt_io *io = container_of(ctx, struct dm_crypt_io, ctx);
+	struct dm_crypt_io *io = ctx->io;
 	struct crypt_config *cc = io->target->private;
 
 	if (error == -EINPROGRESS) {
@@ -1214,13 +1537,14 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 
 	mempool_free(req_of_dmreq(cc, dmreq), cc->req_pool);
 
+	crypt_convert_error(ctx, error);
 	if (!atomic_dec_and_test(&ctx->pending))
 		return;
 
-	if (bio_data_dir(io->base_bio) == READ)
-		kcryptd_crypt_read_done(io, error);
+	if (ctx != &io->ctx)
+		crypt_slice_done(container_of(ctx, struct dm_crypt_slice, ctx));
 	else
-		kcryptd_crypt_write_io_submit(io, error, 1);
+		kcryptd_crypt_done(io, ctx->error, 1);
 }
 
 static void kcryptd_crypt(struct work_struct *work)
@@ -1236,8 +1560,28 @@ static void kcryptd_crypt(struct work_struct *work)
 static void kcryptd_queue_crypt(struct dm_crypt_io *io)
 {
 	struct crypt_config *cc = io->target->private;
+	struct crypt_cpu *this_cc;
+	int cpu, this_cpu;
 
 	INIT_WORK(&io->work, kcryptd_crypt);
+
+	/*
+	 * Writes are queued from the submitter, which is usually busy
+	 * producing the next one; encrypt them elsewhere, round robin.
+	 */
+	if (bio_data_dir(io->base_bio) == WRITE && crypt_cpus_used() > 1) {
+		this_cpu = get_cpu();
+		this_cc = this_crypt_config(cc);
+		cpu = crypt_next_cpu(this_cc->write_cpu);
+		if (cpu == this_cpu)
+			cpu = crypt_next_cpu(cpu);
+		this_cc->write_cpu = cpu;
+		put_cpu();
+
+		queue_work_on(cpu, cc->crypt_queue, &io->work);
+		return;
+	}
+
 	queue_work(cc->crypt_queue, &io->work);
 }
 
@@ -1370,12 +1714,18 @@ static void crypt_dtr(struct dm_target *ti)
 		destroy_workqueue(cc->io_queue);
 	if (cc->crypt_queue)
 		destroy_workqueue(cc->crypt_queue);
+	if (cc->slice_queue)
+		destroy_workqueue(cc->slice_queue);
+
+	if (cc->page_shrinker.shrink)
+		unregister_shrinker(&cc->page_shrinker);
 
 	if (cc->cpu)
 		for_each_possible_cpu(cpu) {
 			cpu_cc = per_cpu_ptr(cc->cpu, cpu);
 			if (cpu_cc->req)
 				mempool_free(cpu_cc->req, cc->req_pool);
+			crypt_page_drain(cc, cpu, UINT_MAX);
 			crypt_free_tfms(cc, cpu);
 		}
 
@@ -1384,6 +1734,8 @@ static void crypt_dtr(struct dm_target *ti)
 
 	if (cc->page_pool)
 		mempool_destroy(cc->page_pool);
+	if (cc->slice_pool)
+		mempool_destroy(cc->slice_pool);
 	if (cc->req_pool)
 		mempool_destroy(cc->req_pool);
 	if (cc->io_pool)
@@ -1411,6 +1763,7 @@ static int crypt_ctr_cipher(struct dm_target *ti,
 	struct crypt_config *cc = ti->private;
 	char *tmp, *cipher, *chainmode, *ivmode, *ivopts, *keycount;
 	char *cipher_api = NULL;
+	struct crypt_cpu *cpu_cc;
 	int cpu, ret = -EINVAL;
 
 	/* Convert to crypto api definition? */
@@ -1459,6 +1812,16 @@ static int crypt_ctr_cipher(struct dm_target *ti,
 		goto bad_mem;
 	}
 
+	for_each_possible_cpu(cpu) {
+		cpu_cc = per_cpu_ptr(cc->cpu, cpu);
+		spin_lock_init(&cpu_cc->page_lock);
+		INIT_LIST_HEAD(&cpu_cc->pages);
+	}
+
+	cc->page_shrinker.shrink = crypt_page_shrink;
+	cc->page_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&cc->page_shrinker);
+
 	/*
 	 * For compatibility with the original dm-crypt mapping format, if
 	 * only the cipher name is supplied, use cbc-plain.
@@ -1622,6 +1985,12 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad;
 	}
 
+	cc->slice_pool = mempool_create_slab_pool(MIN_IOS, _crypt_slice_pool);
+	if (!cc->slice_pool) {
+		ti->error = "Cannot allocate crypt slice mempool";
+		goto bad;
+	}
+
 	cc->bs = bioset_create(MIN_IOS, 0);
 	if (!cc->bs) {
 		ti->error = "Cannot allocate crypt bioset";
@@ -1666,6 +2035,16 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad;
 	}
 
+	cc->slice_queue = alloc_workqueue("kcryptd_slice",
+					  WQ_NON_REENTRANT|
+					  WQ_CPU_INTENSIVE|
+					  WQ_MEM_RECLAIM,
+					  1);
+	if (!cc->slice_queue) {
+		ti->error = "Couldn't create kcryptd slice queue";
+		goto bad;
+	}
+
 	ti->num_flush_requests = 1;
 	return 0;
 
@@ -1701,11 +2080,20 @@ static int crypt_status(struct dm_target *ti, status_type_t type,
 			char *result, unsigned int maxlen)
 {
 	struct crypt_config *cc = ti->private;
+	struct crypt_cpu *cpu_cc;
+	unsigned long long hits = 0, allocs = 0, stalls = 0;
 	unsigned int sz = 0;
+	int cpu;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
-		result[0] = '\0';
+		for_each_possible_cpu(cpu) {
+			cpu_cc = per_cpu_ptr(cc->cpu, cpu);
+			hits += cpu_cc->page_hits;
+			allocs += cpu_cc->page_allocs;
+			stalls += cpu_cc->page_stalls;
+		}
+		DMEMIT("%llu %llu %llu", hits, allocs, stalls);
 		break;
 
 	case STATUSTYPE_TABLE:
@@ -1843,9 +2231,16 @@ static int __init dm_crypt_init(void)
 	if (!_crypt_io_pool)
 		return -ENOMEM;
 
+	_crypt_slice_pool = KMEM_CACHE(dm_crypt_slice, 0);
+	if (!_crypt_slice_pool) {
+		kmem_cache_destroy(_crypt_io_pool);
+		return -ENOMEM;
+	}
+
 	r = dm_register_target(&crypt_target);
 	if (r < 0) {
 		DMERR("register failed %d", r);
+		kmem_cache_destroy(_crypt_slice_pool);
 		kmem_cache_destroy(_crypt_io_pool);
 	}
 
@@ -1855,6 +2250,7 @@ static int __init dm_crypt_init(void)
 static void __exit dm_crypt_exit(void)
 {
 	dm_unregister_target(&crypt_target);
+	kmem_cache_destroy(_crypt_slice_pool);
 	kmem_cache_destroy(_crypt_io_pool);
 }
 
@@ -10,8 +10,10 @@
 #include "persistent-data/dm-space-map-disk.h"
 #include "persistent-data/dm-transaction-manager.h"
 
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/device-mapper.h>
+#include <linux/rcupdate.h>
 #include <linux/workqueue.h>
 
 /*--------------------------------------------------------------------------
@@ -181,8 +183,17 @@ struct dm_pool_metadata {
 	uint64_t trans_id;
 	unsigned long flags;
 	sector_t data_block_size;
+
+	/*
+	 * Commit statistics, protected by root_lock.
+	 */
+	uint64_t nr_commits;
+	uint64_t commit_us_total;
+	uint64_t commit_us_max;
 };
 
+struct lookup_cache_entry;
+
 struct dm_thin_device {
 	struct list_head list;
 	struct dm_pool_metadata *pmd;
@@ -194,8 +205,132 @@ struct dm_thin_device {
 	uint64_t transaction_id;
 	uint32_t creation_time;
 	uint32_t snapshotted_time;
+
+	struct lookup_cache_entry __rcu **cache;
 };
 
+/*----------------------------------------------------------------
+ * Lookup cache
+ *
+ * Each thin device has a small direct-mapped cache of recently used
+ * (virtual block -> block_time) mappings, so that hot blocks can be
+ * mapped without descending the btree or taking the root lock.  The
+ * cache is read under RCU alone.  Entries are only added by lookups
+ * holding root_lock for read, and replaced or removed by updates that
+ * hold it for write, so a cached entry always matches the btree.
+ *
+ * Sharing needs no invalidation: the block_time is cached, and whether
+ * it is shared is worked out from the device's snapshotted_time.
+ *--------------------------------------------------------------*/
+#define LOOKUP_CACHE_SIZE 1024
+
+struct lookup_cache_entry {
+	struct rcu_head rcu;
+	dm_block_t block;
+	uint64_t block_time;
+};
+
+static unsigned lc_slot(dm_block_t block)
+{
+	return block & (LOOKUP_CACHE_SIZE - 1);
+}
+
+static void lc_free_entry(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct lookup_cache_entry, rcu));
+}
+
+static void lc_set(struct dm_thin_device *td, unsigned slot,
+		   struct lookup_cache_entry *e)
+{
+	struct lookup_cache_entry *old;
+
+	/*
+	 * Concurrent lookups may be filling the same slot, so the swap
+	 * must be atomic.  xchg() also orders the initialisation of @e
+	 * before its publication.
+	 */
+	old = xchg((struct lookup_cache_entry **)&td->cache[slot], e);
+	if (old)
+		call_rcu(&old->rcu, lc_free_entry);
+}
+
+static int lc_lookup(struct dm_thin_device *td, dm_block_t block,
+		     uint64_t *block_time)
+{
+	int r = -ENODATA;
+	struct lookup_cache_entry *e;
+
+	if (!td->cache)
+		return r;
+
+	rcu_read_lock();
+	e = rcu_dereference(td->cache[lc_slot(block)]);
+	if (e && e->block == block) {
+		*block_time = e->block_time;
+		r = 0;
+	}
+	rcu_read_unlock();
+
+	return r;
+}
+
+/*
+ * Caller must hold root_lock.  Lookups may hold it for read, as
+ * concurrent lookups all insert what is in the btree.
+ */
+static void lc_insert(struct dm_thin_device *td, dm_block_t block,
+		      uint64_t block_time)
+{
+	struct lookup_cache_entry *e;
+
+	if (!td->cache)
+		return;
+
+	e = kmalloc(sizeof(*e), GFP_NOWAIT);
+	if (!e)
+		return;
+
+	e->block = block;
+	e->block_time = block_time;
+	lc_set(td, lc_slot(block), e);
+}
+
+/*
+ * Caller must hold root_lock for write.
+ */
+static void lc_invalidate(struct dm_thin_device *td, dm_block_t block)
+{
+	unsigned slot = lc_slot(block);
+	struct lookup_cache_entry *e;
+
+	if (!td->cache)
+		return;
+
+	e = rcu_dereference_protected(td->cache[slot], 1);
+	if (e && e->block == block)
+		lc_set(td, slot, NULL);
+}
+
+static void lc_invalidate_all(struct dm_thin_device *td)
+{
+	unsigned slot;
+
+	if (!td->cache)
+		return;
+
+	for (slot = 0; slot < LOOKUP_CACHE_SIZE; slot++)
+		if (rcu_access_pointer(td->cache[slot]))
+			lc_set(td, slot, NULL);
+}
+
+static void __free_device(struct dm_thin_device *td)
+{
+	lc_invalidate_all(td);
+	kfree(td->cache);
+	kfree(td);
+}
+
 /*----------------------------------------------------------------
  * superblock validator
  *--------------------------------------------------------------*/
@@ -483,6 +618,9 @@ static struct dm_pool_metadata *alloc_pmd(struct dm_block_manager *bm,
 	pmd->need_commit = 0;
 	pmd->details_root = 0;
 	INIT_LIST_HEAD(&pmd->thin_devices);
+	pmd->nr_commits = 0;
+	pmd->commit_us_total = 0;
+	pmd->commit_us_max = 0;
 
 	return pmd;
 
@@ -643,7 +781,7 @@ int dm_pool_metadata_close(struct dm_pool_metadata *pmd)
 			open_devices++;
 		else {
 			list_del(&td->list);
-			kfree(td);
+			__free_device(td);
 		}
 	}
 	up_read(&pmd->root_lock);
@@ -668,6 +806,11 @@ int dm_pool_metadata_close(struct dm_pool_metadata *pmd)
 	dm_sm_destroy(pmd->data_sm);
 	kfree(pmd);
 
+	/*
+	 * Wait for lookup cache entries still queued for freeing.
+	 */
+	rcu_barrier();
+
 	return 0;
 }
 
@@ -728,6 +871,12 @@ static int __open_device(struct dm_pool_metadata *pmd,
 	(*td)->creation_time = le32_to_cpu(details_le.creation_time);
 	(*td)->snapshotted_time = le32_to_cpu(details_le.snapshotted_time);
 
+	/*
+	 * The device still works without its lookup cache.
+	 */
+	(*td)->cache = kcalloc(LOOKUP_CACHE_SIZE, sizeof(*(*td)->cache),
+			       GFP_NOIO);
+
 	list_add(&(*td)->list, &pmd->thin_devices);
 
 	return 0;
@@ -904,7 +1053,7 @@ static int __delete_device(struct dm_pool_metadata *pmd, dm_thin_id dev)
 	}
 
 	list_del(&td->list);
-	kfree(td);
+	__free_device(td);
 	r = dm_btree_remove(&pmd->details_info, pmd->details_root,
 			    &key, &pmd->details_root);
 	if (r)
@@ -938,6 +1087,7 @@ static int __trim_thin_dev(struct dm_thin_device *td, sector_t new_size)
 	uint64_t key[2] = { td->id, new_size - 1 };
 
 	td->changed = 1;
+	lc_invalidate_all(td);
 
 	/*
 	 * We need to truncate all the extraneous mappings.
@@ -1051,22 +1201,31 @@ int dm_thin_find_block(struct dm_thin_device *td, dm_block_t block,
 	struct dm_pool_metadata *pmd = td->pmd;
 	dm_block_t keys[2] = { td->id, block };
 
+	r = lc_lookup(td, block, &block_time);
+	if (!r)
+		goto found;
+
 	if (can_block) {
 		down_read(&pmd->root_lock);
 		r = dm_btree_lookup(&pmd->info, pmd->root, keys, &value);
-		if (!r)
+		if (!r) {
 			block_time = le64_to_cpu(value);
+			lc_insert(td, block, block_time);
+		}
 		up_read(&pmd->root_lock);
 
 	} else if (down_read_trylock(&pmd->root_lock)) {
 		r = dm_btree_lookup(&pmd->nb_info, pmd->root, keys, &value);
-		if (!r)
+		if (!r) {
 			block_time = le64_to_cpu(value);
+			lc_insert(td, block, block_time);
+		}
 		up_read(&pmd->root_lock);
 
 	} else
 		return -EWOULDBLOCK;
 
+found:
 	if (!r) {
 		dm_block_t exception_block;
 		uint32_t exception_time;
@@ -1093,8 +1252,17 @@ static int __insert(struct dm_thin_device *td, dm_block_t block,
 
 	r = dm_btree_insert_notify(&pmd->info, pmd->root, keys, &value,
 				   &pmd->root, &inserted);
-	if (r)
+	if (r) {
+		lc_invalidate(td, block);
 		return r;
+	}
+
+	/*
+	 * Replace any cached mapping, e.g. for a block whose sharing has
+	 * just been broken.  If that fails, at least drop the old one.
+	 */
+	lc_invalidate(td, block);
+	lc_insert(td, block, pack_block_time(data_block, pmd->time));
 
 	if (inserted) {
 		td->mapped_blocks++;
@@ -1116,12 +1284,28 @@ int dm_thin_insert_block(struct dm_thin_device *td, dm_block_t block,
 	return r;
 }
 
+void dm_pool_insert_blocks(struct dm_pool_metadata *pmd,
+			   struct dm_thin_insert *inserts, unsigned count)
+{
+	unsigned i;
+
+	down_write(&pmd->root_lock);
+	for (i = 0; i < count; i++) {
+		BUG_ON(inserts[i].td->pmd != pmd);
+		inserts[i].r = __insert(inserts[i].td, inserts[i].block,
+					inserts[i].data_block);
+	}
+	up_write(&pmd->root_lock);
+}
+
 static int __remove(struct dm_thin_device *td, dm_block_t block)
 {
 	int r;
 	struct dm_pool_metadata *pmd = td->pmd;
 	dm_block_t keys[2] = { td->id, block };
 
+	lc_invalidate(td, block);
+
 	r = dm_btree_remove(&pmd->info, pmd->root, keys, &pmd->root);
 	if (r)
 		return r;
@@ -1184,7 +1368,7 @@ static int __write_changed_details(struct dm_pool_metadata *pmd)
 			td->changed = 0;
 		else {
 			list_del(&td->list);
-			kfree(td);
+			__free_device(td);
 		}
 
 		pmd->need_commit = 1;
@@ -1202,6 +1386,8 @@ int dm_pool_commit_metadata(struct dm_pool_metadata *pmd)
 	int r;
 	size_t len;
 	struct thin_disk_superblock *disk_super;
+	ktime_t start;
+	uint64_t us;
 
 	/*
 	 * We need to know if the thin_disk_superblock exceeds a 512-byte sector.
@@ -1209,6 +1395,7 @@ int dm_pool_commit_metadata(struct dm_pool_metadata *pmd)
 	BUILD_BUG_ON(sizeof(struct thin_disk_superblock) > 512);
 
 	down_write(&pmd->root_lock);
+	start = ktime_get();
 	r = __write_changed_details(pmd);
 	if (r < 0)
 		goto out;
@@ -1243,6 +1430,11 @@ int dm_pool_commit_metadata(struct dm_pool_metadata *pmd)
 	if (r < 0)
 		goto out;
 
+	us = ktime_us_delta(ktime_get(), start);
+	pmd->nr_commits++;
+	pmd->commit_us_total += us;
+	pmd->commit_us_max = max(pmd->commit_us_max, us);
+
 	/*
 	 * Open the next transaction.
 	 */
@@ -1361,6 +1553,24 @@ static int __resize_data_dev(struct dm_pool_metadata *pmd, dm_block_t new_count)
 	return r;
 }
 
+int dm_pool_get_metadata_stats(struct dm_pool_metadata *pmd,
+			       struct dm_pool_metadata_stats *result)
+{
+	struct dm_bm_stats bm_stats;
+
+	dm_bm_get_stats(pmd->bm, &bm_stats);
+	result->cache_hits = bm_stats.hits;
+	result->cache_misses = bm_stats.misses;
+
+	down_read(&pmd->root_lock);
+	result->nr_commits = pmd->nr_commits;
+	result->commit_us_total = pmd->commit_us_total;
+	result->commit_us_max = pmd->commit_us_max;
+	up_read(&pmd->root_lock);
+
+	return 0;
+}
+
 int dm_pool_resize_data_dev(struct dm_pool_metadata *pmd, dm_block_t new_count)
 {
 	int r;
@@ -136,6 +136,21 @@ int dm_thin_insert_block(struct dm_thin_device *td, dm_block_t block,
 
 int dm_thin_remove_block(struct dm_thin_device *td, dm_block_t block);
 
+/*
+ * Inserts a batch of mappings, possibly for different devices, taking
+ * the metadata lock only once.  Each insertion's result is returned in
+ * its r field; later insertions are still attempted after a failure.
+ */
+struct dm_thin_insert {
+	struct dm_thin_device *td;
+	dm_block_t block;
+	dm_block_t data_block;
+	int r;
+};
+
+void dm_pool_insert_blocks(struct dm_pool_metadata *pmd,
+			   struct dm_thin_insert *inserts, unsigned count);
+
 /*
  * Queries.
  */
@@ -154,6 +169,17 @@ int dm_pool_get_data_block_size(struct dm_pool_metadata *pmd, sector_t *result);
 
 int dm_pool_get_data_dev_size(struct dm_pool_metadata *pmd, dm_block_t *result);
 
+struct dm_pool_metadata_stats {
+	uint64_t cache_hits;		/* Metadata block cache */
+	uint64_t cache_misses;
+	uint64_t nr_commits;		/* Commits that wrote anything */
+	uint64_t commit_us_total;
+	uint64_t commit_us_max;
+};
+
+int dm_pool_get_metadata_stats(struct dm_pool_metadata *pmd,
+			       struct dm_pool_metadata_stats *result);
+
 /*
  * Returns -ENOSPC if the new size is too small and already allocated
  * blocks would be lost.
@@ -9,9 +9,13 @@
 #include <linux/device-mapper.h>
 #include <linux/dm-io.h>
 #include <linux/dm-kcopyd.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/log2.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
 
 #define	DM_MSG_PREFIX	"thin"
@@ -23,6 +27,8 @@
 #define DEFERRED_SET_SIZE 64
 #define MAPPING_POOL_SIZE 1024
 #define PRISON_CELLS 1024
+#define MAPPING_BATCH_SIZE 64
+#define MAX_SHARDS 16
 
 /*
  * The block size of the device holding pool data must be
@@ -446,6 +452,82 @@ static void build_virtual_key(struct dm_thin_device *td, dm_block_t b,
 /*----------------------------------------------------------------*/
 
 struct new_mapping;
+struct pool;
+
+/*
+ * Deferred bios are spread over several shards, each with its own worker,
+ * so that lookups and data block allocation for different blocks proceed
+ * in parallel.  All bios for a given virtual block go to the same shard.
+ */
+struct pool_shard {
+	struct pool *pool;
+	struct work_struct worker;
+
+	spinlock_t lock;
+	struct bio_list deferred_bios;
+
+	struct new_mapping *next_mapping;
+};
+
+/*
+ * Provisioning latency histogram.  Bucket i counts the new mappings that
+ * took between 2^i and 2^(i+1) microseconds from the allocation of their
+ * data block to their insertion into the metadata.
+ */
+#define LATENCY_BUCKETS 32
+
+struct latency_histogram {
+	spinlock_t lock;
+	uint64_t total;
+	uint64_t buckets[LATENCY_BUCKETS];
+};
+
+static void lh_init(struct latency_histogram *lh)
+{
+	spin_lock_init(&lh->lock);
+	lh->total = 0;
+	memset(lh->buckets, 0, sizeof(lh->buckets));
+}
+
+static void lh_record(struct latency_histogram *lh, s64 us)
+{
+	unsigned long flags;
+	unsigned b = us > 1 ? ilog2((uint64_t)us) : 0;
+
+	b = min_t(unsigned, b, LATENCY_BUCKETS - 1);
+
+	spin_lock_irqsave(&lh->lock, flags);
+	lh->total++;
+	lh->buckets[b]++;
+	spin_unlock_irqrestore(&lh->lock, flags);
+}
+
+/*
+ * Returns an upper bound, in microseconds, on the @pct'th percentile of
+ * the recorded latencies, or 0 if nothing has been recorded.
+ */
+static uint64_t lh_percentile(struct latency_histogram *lh, unsigned pct)
+{
+	unsigned long flags;
+	uint64_t target, seen = 0;
+	unsigned b;
+
+	spin_lock_irqsave(&lh->lock, flags);
+	if (!lh->total) {
+		spin_unlock_irqrestore(&lh->lock, flags);
+		return 0;
+	}
+
+	target = div_u64(lh->total * pct + 99, 100);
+	for (b = 0; b < LATENCY_BUCKETS - 1; b++) {
+		seen += lh->buckets[b];
+		if (seen >= target)
+			break;
+	}
+	spin_unlock_irqrestore(&lh->lock, flags);
+
+	return (2ULL << b) - 1;
+}
 
 /*
  * A pool device ties together a metadata device and a data device.  It
@@ -469,18 +551,31 @@ struct pool {
 	struct dm_kcopyd_client *copier;
 
 	struct workqueue_struct *wq;
-	struct work_struct worker;
+	struct work_struct worker;	/* Inserts mappings, commits */
+
+	unsigned nr_shards;
+	struct pool_shard *shards;
+
+	/*
+	 * Bios for different virtual blocks, and so on different shards,
+	 * may share a data block.  This serializes the shard workers'
+	 * use of data block cells.
+	 */
+	struct mutex data_cell_lock;
 
 	spinlock_t lock;
-	struct bio_list deferred_bios;
 	struct list_head prepared_mappings;
+	struct bio_list deferred_flush_bios;
 
 	int low_water_triggered;	/* A dm event has been sent */
 	struct bio_list retry_list;
 
 	struct deferred_set ds;	/* FIXME: move to thin_c */
 
-	struct new_mapping *next_mapping;
+	/* Only used by the worker, to batch mapping insertions */
+	struct dm_thin_insert inserts[MAPPING_BATCH_SIZE];
+
+	struct latency_histogram provision_latency;
 
 	mempool_t *mapping_pool;
 	mempool_t *endio_hook_pool;
@@ -582,30 +677,75 @@ static void remap(struct thin_c *tc, struct bio *bio, dm_block_t block)
 		(bio->bi_sector & pool->offset_mask);
 }
 
-static void remap_and_issue(struct thin_c *tc, struct bio *bio,
-			    dm_block_t block)
+/*
+ * wake_worker() kicks the pool's worker, which inserts prepared mappings
+ * and commits the metadata for deferred flushes.  wake_shard() kicks the
+ * worker processing a shard's deferred bios.
+ */
+static void wake_worker(struct pool *pool)
 {
-	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
-		int r = dm_pool_commit_metadata(tc->pool->pmd);
-		if (r) {
-			DMERR("%s: dm_pool_commit_metadata() failed, error = %d",
-			      __func__, r);
-			bio_io_error(bio);
-			return;
-		}
-	}
+	queue_work(pool->wq, &pool->worker);
+}
 
-	remap(tc, bio, block);
-	generic_make_request(bio);
+static void wake_shard(struct pool_shard *shard)
+{
+	queue_work(shard->pool->wq, &shard->worker);
+}
+
+static void wake_shards(struct pool *pool)
+{
+	unsigned i;
+
+	for (i = 0; i < pool->nr_shards; i++)
+		wake_shard(pool->shards + i);
+}
+
+static struct pool_shard *get_bio_shard(struct thin_c *tc, struct bio *bio)
+{
+	struct pool *pool = tc->pool;
+	uint64_t key = get_bio_block(tc, bio) ^ ((uint64_t)tc->dev_id << 40);
+
+	return pool->shards + hash_64(key, 32) % pool->nr_shards;
 }
 
 /*
- * wake_worker() is used by thin_defer_bio and pool_preresume to continue
- * deferred IO processing after pool resume.
+ * Hands a bio over to the worker of its shard.
  */
-static void wake_worker(struct pool *pool)
+static void thin_defer_bio(struct thin_c *tc, struct bio *bio)
 {
-	queue_work(pool->wq, &pool->worker);
+	unsigned long flags;
+	struct pool_shard *shard = get_bio_shard(tc, bio);
+
+	spin_lock_irqsave(&shard->lock, flags);
+	bio_list_add(&shard->deferred_bios, bio);
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	wake_shard(shard);
+}
+
+/*
+ * REQ_FLUSH and REQ_FUA bios may only be issued once the metadata has been
+ * committed.  Rather than committing for each of them, they are queued for
+ * the pool's worker, so one commit covers all that arrive meanwhile.
+ */
+static void remap_and_issue(struct thin_c *tc, struct bio *bio,
+			    dm_block_t block)
+{
+	struct pool *pool = tc->pool;
+	unsigned long flags;
+
+	remap(tc, bio, block);
+
+	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
+		spin_lock_irqsave(&pool->lock, flags);
+		bio_list_add(&pool->deferred_flush_bios, bio);
+		spin_unlock_irqrestore(&pool->lock, flags);
+
+		wake_worker(pool);
+		return;
+	}
+
+	generic_make_request(bio);
 }
 
 /*----------------------------------------------------------------*/
@@ -630,6 +770,7 @@ struct new_mapping {
 	dm_block_t data_block;
 	struct cell *cell;
 	int err;
+	ktime_t start;
 
 	/*
 	 * If the bio covers the whole area of a block then we can avoid
@@ -722,23 +863,24 @@ static void save_and_set_endio(struct bio *bio, bio_end_io_t **save,
 	bio->bi_end_io = fn;
 }
 
-static int ensure_next_mapping(struct pool *pool)
+static int ensure_next_mapping(struct pool_shard *shard)
 {
-	if (pool->next_mapping)
+	if (shard->next_mapping)
 		return 0;
 
-	pool->next_mapping = mempool_alloc(pool->mapping_pool, GFP_ATOMIC);
+	shard->next_mapping = mempool_alloc(shard->pool->mapping_pool,
+					    GFP_ATOMIC);
 
-	return pool->next_mapping ? 0 : -ENOMEM;
+	return shard->next_mapping ? 0 : -ENOMEM;
 }
 
-static struct new_mapping *get_next_mapping(struct pool *pool)
+static struct new_mapping *get_next_mapping(struct pool_shard *shard)
 {
-	struct new_mapping *r = pool->next_mapping;
+	struct new_mapping *r = shard->next_mapping;
 
-	BUG_ON(!pool->next_mapping);
+	BUG_ON(!shard->next_mapping);
 
-	pool->next_mapping = NULL;
+	shard->next_mapping = NULL;
 
 	return r;
 }
@@ -749,7 +891,7 @@ static void schedule_copy(struct thin_c *tc, dm_block_t virt_block,
 {
 	int r;
 	struct pool *pool = tc->pool;
-	struct new_mapping *m = get_next_mapping(pool);
+	struct new_mapping *m = get_next_mapping(get_bio_shard(tc, bio));
 
 	INIT_LIST_HEAD(&m->list);
 	m->prepared = 0;
@@ -758,6 +900,7 @@ static void schedule_copy(struct thin_c *tc, dm_block_t virt_block,
 	m->data_block = data_dest;
 	m->cell = cell;
 	m->err = 0;
+	m->start = ktime_get();
 	m->bio = NULL;
 
 	ds_add_work(&pool->ds, &m->list);
@@ -799,7 +942,7 @@ static void schedule_zero(struct thin_c *tc, dm_block_t virt_block,
 			  struct bio *bio)
 {
 	struct pool *pool = tc->pool;
-	struct new_mapping *m = get_next_mapping(pool);
+	struct new_mapping *m = get_next_mapping(get_bio_shard(tc, bio));
 
 	INIT_LIST_HEAD(&m->list);
 	m->prepared = 0;
@@ -808,6 +951,7 @@ static void schedule_zero(struct thin_c *tc, dm_block_t virt_block,
 	m->data_block = data_block;
 	m->cell = cell;
 	m->err = 0;
+	m->start = ktime_get();
 	m->bio = NULL;
 
 	/*
@@ -850,7 +994,7 @@ static void retry_later(struct bio *bio)
 
 static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
 {
-	int r;
+	int r, triggered;
 	dm_block_t free_blocks;
 	unsigned long flags;
 	struct pool *pool = tc->pool;
@@ -859,11 +1003,14 @@ static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
 	if (r)
 		return r;
 
-	if (free_blocks <= pool->low_water_mark && !pool->low_water_triggered) {
+	if (free_blocks <= pool->low_water_mark) {
 		spin_lock_irqsave(&pool->lock, flags);
+		triggered = pool->low_water_triggered;
 		pool->low_water_triggered = 1;
 		spin_unlock_irqrestore(&pool->lock, flags);
-		dm_table_event(pool->ti->table);
+
+		if (!triggered)
+			dm_table_event(pool->ti->table);
 	}
 
 	r = dm_pool_alloc_data_block(pool->pmd, result);
@@ -922,14 +1069,21 @@ static void process_shared_bio(struct thin_c *tc, struct bio *bio,
 	/*
 	 * If cell is already occupied, then sharing is already in the process
 	 * of being broken so we have nothing further to do here.
+	 *
+	 * Another shard may detain a bio into the same cell, so a read must
+	 * hold data_cell_lock until it has taken itself out again.
 	 */
+	mutex_lock(&pool->data_cell_lock);
 	build_data_key(tc->td, lookup_result->block, &key);
-	if (bio_detain(pool->prison, &key, bio, &cell))
+	if (bio_detain(pool->prison, &key, bio, &cell)) {
+		mutex_unlock(&pool->data_cell_lock);
 		return;
+	}
 
-	if (bio_data_dir(bio) == WRITE)
+	if (bio_data_dir(bio) == WRITE) {
+		mutex_unlock(&pool->data_cell_lock);
 		break_sharing(tc, bio, block, &key, lookup_result, cell);
-	else {
+	} else {
 		struct endio_hook *h;
 		h = mempool_alloc(pool->endio_hook_pool, GFP_NOIO);
 
@@ -939,6 +1093,7 @@ static void process_shared_bio(struct thin_c *tc, struct bio *bio,
 		dm_get_mapinfo(bio)->ptr = h;
 
 		cell_release_singleton(cell, bio);
+		mutex_unlock(&pool->data_cell_lock);
 		remap_and_issue(tc, bio, lookup_result->block);
 	}
 }
@@ -986,9 +1141,9 @@ static void process_bio(struct thin_c *tc, struct bio *bio)
 	switch (r) {
 	case 0:
 		/*
-		 * We can release this cell now.  This thread is the only
-		 * one that puts bios into a cell, and we know there were
-		 * no preceeding bios.
+		 * We can release this cell now.  Only this shard's worker
+		 * puts bios for this block into a cell, and we know there
+		 * were no preceeding bios.
 		 */
 		cell_release_singleton(cell, bio);
 
@@ -1009,7 +1164,7 @@ static void process_bio(struct thin_c *tc, struct bio *bio)
 	}
 }
 
-static void process_deferred_bios(struct pool *pool)
+static void process_deferred_bios(struct pool_shard *shard)
 {
 	unsigned long flags;
 	struct bio *bio;
@@ -1017,10 +1172,10 @@ static void process_deferred_bios(struct pool *pool)
 
 	bio_list_init(&bios);
 
-	spin_lock_irqsave(&pool->lock, flags);
-	bio_list_merge(&bios, &pool->deferred_bios);
-	bio_list_init(&pool->deferred_bios);
-	spin_unlock_irqrestore(&pool->lock, flags);
+	spin_lock_irqsave(&shard->lock, flags);
+	bio_list_merge(&bios, &shard->deferred_bios);
+	bio_list_init(&shard->deferred_bios);
+	spin_unlock_irqrestore(&shard->lock, flags);
 
 	while ((bio = bio_list_pop(&bios))) {
 		struct thin_c *tc = dm_get_mapinfo(bio)->ptr;
@@ -1030,10 +1185,12 @@ static void process_deferred_bios(struct pool *pool)
 		 * might require one, we pause until there are some prepared mappings to
 		 * process.
 		 */
-		if (ensure_next_mapping(pool)) {
-			spin_lock_irqsave(&pool->lock, flags);
-			bio_list_merge(&pool->deferred_bios, &bios);
-			spin_unlock_irqrestore(&pool->lock, flags);
+		if (ensure_next_mapping(shard)) {
+			bio_list_add_head(&bios, bio);
+
+			spin_lock_irqsave(&shard->lock, flags);
+			bio_list_merge_head(&shard->deferred_bios, &bios);
+			spin_unlock_irqrestore(&shard->lock, flags);
 
 			return;
 		}
@@ -1043,85 +1200,144 @@ static void process_deferred_bios(struct pool *pool)
 }
 
 /*
- * This sends the bios in the cell back to the deferred_bios list.
+ * This sends the bios in the cell, bar @exception, back to the
+ * deferred_bios lists of their shards.  A data block cell may hold bios
+ * for several thin devices, so each goes back with its own thin_c.
  */
-static void cell_defer(struct thin_c *tc, struct cell *cell,
-		       dm_block_t data_block)
-{
-	struct pool *pool = tc->pool;
-	unsigned long flags;
-
-	spin_lock_irqsave(&pool->lock, flags);
-	cell_release(cell, &pool->deferred_bios);
-	spin_unlock_irqrestore(&pool->lock, flags);
-
-	wake_worker(pool);
-}
-
-static void cell_defer_except(struct thin_c *tc, struct cell *cell,
-			      struct bio *exception)
+static void cell_defer_except(struct cell *cell, struct bio *exception)
 {
 	struct bio_list bios;
 	struct bio *bio;
-	struct pool *pool = tc->pool;
-	unsigned long flags;
 
 	bio_list_init(&bios);
 	cell_release(cell, &bios);
 
-	spin_lock_irqsave(&pool->lock, flags);
 	while ((bio = bio_list_pop(&bios)))
 		if (bio != exception)
-			bio_list_add(&pool->deferred_bios, bio);
-	spin_unlock_irqrestore(&pool->lock, flags);
+			thin_defer_bio(dm_get_mapinfo(bio)->ptr, bio);
+}
 
-	wake_worker(pool);
+static void cell_defer(struct thin_c *tc, struct cell *cell,
+		       dm_block_t data_block)
+{
+	cell_defer_except(cell, NULL);
 }
 
-static void process_prepared_mapping(struct new_mapping *m)
+/*
+ * @r is the result of inserting the mapping into the metadata.
+ */
+static void process_prepared_mapping(struct new_mapping *m, int r)
 {
 	struct thin_c *tc = m->tc;
+	struct pool *pool = tc->pool;
 	struct bio *bio;
-	int r;
 
 	bio = m->bio;
 	if (bio)
 		bio->bi_end_io = m->saved_bi_end_io;
 
-	if (m->err) {
+	if (m->err)
 		cell_error(m->cell);
-		return;
-	}
 
-	r = dm_thin_insert_block(tc->td, m->virt_block, m->data_block);
-	if (r) {
+	else if (r) {
 		DMERR("dm_thin_insert_block() failed");
 		cell_error(m->cell);
-		return;
-	}
 
-	if (bio) {
-		cell_defer_except(tc, m->cell, bio);
-		bio_endio(bio, 0);
-	} else
-		cell_defer(tc, m->cell, m->data_block);
+	} else {
+		if (bio) {
+			cell_defer_except(m->cell, bio);
+			bio_endio(bio, 0);
+		} else
+			cell_defer(tc, m->cell, m->data_block);
+
+		lh_record(&pool->provision_latency,
+			  ktime_us_delta(ktime_get(), m->start));
+	}
 
-	mempool_free(m, tc->pool->mapping_pool);
+	mempool_free(m, pool->mapping_pool);
 }
 
+/*
+ * Mappings are inserted in batches of up to MAPPING_BATCH_SIZE, each
+ * batch under a single acquisition of the metadata lock, so that the
+ * shard workers' lookups aren't held off once per new mapping.
+ */
 static void process_prepared_mappings(struct pool *pool)
 {
 	unsigned long flags;
-	struct list_head maps;
-	struct new_mapping *m;
+	struct list_head maps, batch;
+	struct new_mapping *m, *tmp;
+	unsigned count;
 
 	INIT_LIST_HEAD(&maps);
 	spin_lock_irqsave(&pool->lock, flags);
 	list_splice_init(&pool->prepared_mappings, &maps);
 	spin_unlock_irqrestore(&pool->lock, flags);
 
-	list_for_each_entry(m, &maps, list)
-		process_prepared_mapping(m);
+	if (list_empty(&maps))
+		return;
+
+	while (!list_empty(&maps)) {
+		INIT_LIST_HEAD(&batch);
+		count = 0;
+
+		list_for_each_entry_safe(m, tmp, &maps, list) {
+			list_del(&m->list);
+			if (m->err) {
+				process_prepared_mapping(m, 0);
+				continue;
+			}
+
+			pool->inserts[count].td = m->tc->td;
+			pool->inserts[count].block = m->virt_block;
+			pool->inserts[count].data_block = m->data_block;
+			list_add_tail(&m->list, &batch);
+			if (++count == MAPPING_BATCH_SIZE)
+				break;
+		}
+
+		if (count)
+			dm_pool_insert_blocks(pool->pmd, pool->inserts, count);
+
+		count = 0;
+		list_for_each_entry_safe(m, tmp, &batch, list)
+			process_prepared_mapping(m, pool->inserts[count++].r);
+	}
+
+	/*
+	 * Shards may have stalled for want of a new_mapping struct.
+	 */
+	wake_shards(pool);
+}
+
+static void process_deferred_flush_bios(struct pool *pool)
+{
+	int r;
+	unsigned long flags;
+	struct bio *bio;
+	struct bio_list bios;
+
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&pool->lock, flags);
+	bio_list_merge(&bios, &pool->deferred_flush_bios);
+	bio_list_init(&pool->deferred_flush_bios);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (bio_list_empty(&bios))
+		return;
+
+	r = dm_pool_commit_metadata(pool->pmd);
+	if (r) {
+		DMERR("%s: dm_pool_commit_metadata() failed, error = %d",
+		      __func__, r);
+		while ((bio = bio_list_pop(&bios)))
+			bio_io_error(bio);
+		return;
+	}
+
+	while ((bio = bio_list_pop(&bios)))
+		generic_make_request(bio);
 }
 
 static void do_worker(struct work_struct *ws)
@@ -1129,7 +1345,14 @@ static void do_worker(struct work_struct *ws)
 	struct pool *pool = container_of(ws, struct pool, worker);
 
 	process_prepared_mappings(pool);
-	process_deferred_bios(pool);
+	process_deferred_flush_bios(pool);
+}
+
+static void do_shard_worker(struct work_struct *ws)
+{
+	struct pool_shard *shard = container_of(ws, struct pool_shard, worker);
+
+	process_deferred_bios(shard);
 }
 
 /*----------------------------------------------------------------*/
@@ -1138,21 +1361,6 @@ static void do_worker(struct work_struct *ws)
  * Mapping functions.
  */
 
-/*
- * Called only while mapping a thin bio to hand it over to the producer queue.
- */
-static void thin_defer_bio(struct thin_c *tc, struct bio *bio)
-{
-	unsigned long flags;
-	struct pool *pool = tc->pool;
-
-	spin_lock_irqsave(&pool->lock, flags);
-	bio_list_add(&pool->deferred_bios, bio);
-	spin_unlock_irqrestore(&pool->lock, flags);
-
-	wake_worker(pool);
-}
-
 /*
  * Non-blocking function designed to be called from the target's map
  * function.
@@ -1264,6 +1472,8 @@ static void unbind_control_target(struct pool *pool, struct dm_target *ti)
  *--------------------------------------------------------------*/
 static void pool_destroy(struct pool *pool)
 {
+	unsigned i;
+
 	if (dm_pool_metadata_close(pool->pmd) < 0)
 		DMWARN("%s: dm_pool_metadata_close() failed.", __func__);
 
@@ -1273,6 +1483,12 @@ static void pool_destroy(struct pool *pool)
 	if (pool->wq)
 		destroy_workqueue(pool->wq);
 
+	for (i = 0; i < pool->nr_shards; i++)
+		if (pool->shards[i].next_mapping)
+			mempool_free(pool->shards[i].next_mapping,
+				     pool->mapping_pool);
+	kfree(pool->shards);
+
 	mempool_destroy(pool->mapping_pool);
 	mempool_destroy(pool->endio_hook_pool);
 	kfree(pool);
@@ -1282,6 +1498,7 @@ static struct pool *pool_create(struct block_device *metadata_dev,
 				unsigned long block_size, char **error)
 {
 	int r;
+	unsigned i;
 	void *err_p;
 	struct pool *pool;
 	struct dm_pool_metadata *pmd;
@@ -1321,25 +1538,51 @@ static struct pool *pool_create(struct block_device *metadata_dev,
 	}
 
 	/*
-	 * Create singlethreaded workqueue that will service all devices
-	 * that use this metadata.
+	 * Create the workqueue that will service all devices that use this
+	 * metadata.  It runs the pool's worker and one worker per shard;
+	 * non-reentrance keeps each of those single-threaded.  It is
+	 * unbound so that the shards run on any idle CPU rather than on
+	 * the one that queued them, which may be a single submitter's.
 	 */
-	pool->wq = alloc_ordered_workqueue("dm-" DM_MSG_PREFIX, WQ_MEM_RECLAIM);
+	pool->wq = alloc_workqueue("dm-" DM_MSG_PREFIX,
+				   WQ_UNBOUND | WQ_NON_REENTRANT |
+				   WQ_MEM_RECLAIM, 0);
 	if (!pool->wq) {
 		*error = "Error creating pool's workqueue";
 		err_p = ERR_PTR(-ENOMEM);
 		goto bad_wq;
 	}
 
+	pool->nr_shards = min_t(unsigned, num_online_cpus(), MAX_SHARDS);
+	pool->shards = kcalloc(pool->nr_shards, sizeof(*pool->shards),
+			       GFP_KERNEL);
+	if (!pool->shards) {
+		*error = "Error allocating pool's shards";
+		err_p = ERR_PTR(-ENOMEM);
+		goto bad_shards;
+	}
+
+	for (i = 0; i < pool->nr_shards; i++) {
+		struct pool_shard *shard = pool->shards + i;
+
+		shard->pool = pool;
+		INIT_WORK(&shard->worker, do_shard_worker);
+		spin_lock_init(&shard->lock);
+		bio_list_init(&shard->deferred_bios);
+		shard->next_mapping = NULL;
+	}
+
+	mutex_init(&pool->data_cell_lock);
+
 	INIT_WORK(&pool->worker, do_worker);
 	spin_lock_init(&pool->lock);
-	bio_list_init(&pool->deferred_bios);
 	INIT_LIST_HEAD(&pool->prepared_mappings);
+	bio_list_init(&pool->deferred_flush_bios);
 	pool->low_water_triggered = 0;
 	bio_list_init(&pool->retry_list);
 	ds_init(&pool->ds);
+	lh_init(&pool->provision_latency);
 
-	pool->next_mapping = NULL;
 	pool->mapping_pool =
 		mempool_create_kmalloc_pool(MAPPING_POOL_SIZE, sizeof(struct new_mapping));
 	if (!pool->mapping_pool) {
@@ -1362,6 +1605,8 @@ static struct pool *pool_create(struct block_device *metadata_dev,
 bad_endio_hook_pool:
 	mempool_destroy(pool->mapping_pool);
 bad_mapping_pool:
+	kfree(pool->shards);
+bad_shards:
 	destroy_workqueue(pool->wq);
 bad_wq:
 	dm_kcopyd_client_destroy(pool->copier);
@@ -1588,10 +1833,21 @@ static void pool_dtr(struct dm_target *ti)
 	kfree(pt);
 }
 
-static void __requeue_bios(struct pool *pool)
+static void requeue_bios(struct pool *pool)
 {
-	bio_list_merge(&pool->deferred_bios, &pool->retry_list);
+	unsigned long flags;
+	struct bio *bio;
+	struct bio_list bios;
+
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&pool->lock, flags);
+	bio_list_merge(&bios, &pool->retry_list);
 	bio_list_init(&pool->retry_list);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	while ((bio = bio_list_pop(&bios)))
+		thin_defer_bio(dm_get_mapinfo(bio)->ptr, bio);
 }
 
 /*
@@ -1649,10 +1905,10 @@ static int pool_preresume(struct dm_target *ti)
 
 	spin_lock_irqsave(&pool->lock, flags);
 	pool->low_water_triggered = 0;
-	__requeue_bios(pool);
 	spin_unlock_irqrestore(&pool->lock, flags);
 
-	wake_worker(pool);
+	requeue_bios(pool);
+	wake_shards(pool);
 
 	/*
 	 * The pool object is only present if the pool is active.
@@ -1879,6 +2135,9 @@ static int pool_message(struct dm_target *ti, unsigned argc, char **argv)
  * Status line is:
  *    <transaction id> <free metadata space in sectors>
  *    <free data space in sectors> <held metadata root>
+ *    <provisioning latency percentiles in microseconds: 50th 90th 99th>
+ *    <metadata cache hits> <metadata cache misses>
+ *    <average metadata commit latency in microseconds> <maximum>
  */
 static int pool_status(struct dm_target *ti, status_type_t type,
 		       char *result, unsigned maxlen)
@@ -1889,6 +2148,7 @@ static int pool_status(struct dm_target *ti, status_type_t type,
 	dm_block_t nr_free_blocks_data;
 	dm_block_t nr_free_blocks_metadata;
 	dm_block_t held_root;
+	struct dm_pool_metadata_stats stats;
 	char buf[BDEVNAME_SIZE];
 	char buf2[BDEVNAME_SIZE];
 	struct pool_c *pt = ti->private;
@@ -1915,15 +2175,30 @@ static int pool_status(struct dm_target *ti, status_type_t type,
 		if (r)
 			return r;
 
+		r = dm_pool_get_metadata_stats(pool->pmd, &stats);
+		if (r)
+			return r;
+
 		DMEMIT("%llu %llu %llu ", (unsigned long long)transaction_id,
 		       (unsigned long long)nr_free_blocks_metadata * pool->sectors_per_block,
 		       (unsigned long long)nr_free_blocks_data * pool->sectors_per_block);
 
 		if (held_root)
-			DMEMIT("%llu", held_root);
+			DMEMIT("%llu ", held_root);
 		else
-			DMEMIT("-");
-
+			DMEMIT("- ");
+
+		DMEMIT("%llu %llu %llu",
+		       (unsigned long long)lh_percentile(&pool->provision_latency, 50),
+		       (unsigned long long)lh_percentile(&pool->provision_latency, 90),
+		       (unsigned long long)lh_percentile(&pool->provision_latency, 99));
+
+		DMEMIT(" %llu %llu %llu %llu",
+		       (unsigned long long)stats.cache_hits,
+		       (unsigned long long)stats.cache_misses,
+		       (unsigned long long)(stats.nr_commits ?
+			div64_u64(stats.commit_us_total, stats.nr_commits) : 0),
+		       (unsigned long long)stats.commit_us_max);
 		break;
 
 	case STATUSTYPE_TABLE:
@@ -1977,7 +2252,7 @@ static void pool_io_hints(struct dm_target *ti, struct queue_limits *limits)
 static struct target_type pool_target = {
 	.name = "thin-pool",
 	.features = DM_TARGET_SINGLETON | DM_TARGET_ALWAYS_WRITEABLE,
-	.version = {1, 0, 0},
+	.version = {1, 1, 0},
 	.module = THIS_MODULE,
 	.ctr = pool_ctr,
 	.dtr = pool_dtr,
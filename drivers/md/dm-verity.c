@@ -14,6 +14,7 @@
 #include <linux/async.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/cpumask.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/err.h>
@@ -23,6 +24,7 @@
 #include <linux/mempool.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 #include <asm/atomic.h>
 #include <asm/page.h>
@@ -101,6 +103,40 @@ module_param(error_behavior, charp, 0644);
 MODULE_PARM_DESC(error_behavior, "Behavior on error "
 				 "(eio, panic, none, notify)");
 
+/* Bounds how many CPUs the hashing of a single request is spread across.
+ * 0 uses every online CPU; 1 keeps all hashing on the CPU which completed
+ * the data I/O (the historical behavior).
+ */
+static unsigned int verify_cpus;
+module_param(verify_cpus, uint, 0644);
+MODULE_PARM_DESC(verify_cpus, "Max CPUs used to verify one request "
+			      "(0 = all online)");
+
+/* Smallest number of blocks handed to a single verify worker.  Anything
+ * smaller is not worth the cross-CPU wakeup.
+ */
+static unsigned int verify_batch = 8;
+module_param(verify_batch, uint, 0644);
+MODULE_PARM_DESC(verify_batch, "Min blocks verified per worker");
+
+/* Number of leaf entries (pages of block hashes) of the tree to read ahead
+ * of a sequential reader.  0 disables hash tree readahead.
+ */
+static unsigned int bht_readahead = 1;
+module_param(bht_readahead, uint, 0644);
+MODULE_PARM_DESC(bht_readahead, "Hash tree entries to prefetch on "
+				"sequential reads (0 = off)");
+
+/* Upper bound, in KiB, on the bitmap remembering which blocks of a device
+ * have already been verified.  Blocks with their bit set are not hashed
+ * again when re-read after leaving the page cache.  Only read when a device
+ * is created.  0 disables the bitmap.
+ */
+static unsigned int verified_cache_kb;
+module_param(verified_cache_kb, uint, 0644);
+MODULE_PARM_DESC(verified_cache_kb, "Max KiB per device for the verified "
+				    "block bitmap (0 = off)");
+
 /* Controls whether verity_get_device will wait forever for a device. */
 static int dev_wait;
 module_param(dev_wait, bool, 0444);
@@ -115,11 +151,16 @@ struct verity_stats {
 	unsigned int average_requeues;
 	unsigned int total_requeues;
 	unsigned long long total_requests;
+	unsigned long long total_verify_slices;
+	unsigned long long total_bht_prefetches;  /* entry reads issued ahead */
+	unsigned long long total_bht_prefetch_hits;  /* stalls avoided */
+	unsigned long long total_verified_hits;  /* blocks not rehashed */
 };
 
 /* per-requested-bio private data */
 enum verity_io_flags {
 	VERITY_IOFLAGS_CLONED = 0x1,	/* original bio has been cloned */
+	VERITY_IOFLAGS_PREFETCH = 0x2,	/* hash tree readahead, no bio */
 };
 
 struct dm_verity_io {
@@ -130,12 +171,24 @@ struct dm_verity_io {
 
 	int error;
 	atomic_t pending;
+	atomic_t verify_pending;  /* slices still being hashed */
 
 	sector_t sector;  /* converted to target sector */
 	u64 block;  /* aligned block index */
 	u64 count;  /* aligned count in blocks */
 };
 
+/* A contiguous run of a dm_verity_io's bio_vecs handed to the verify
+ * workqueue on another CPU.  The slices of one io complete in any order;
+ * the last one to finish returns the bio to the caller.
+ */
+struct dm_verity_slice {
+	struct work_struct work;
+	struct dm_verity_io *io;
+	unsigned short idx;  /* first bio_vec to verify */
+	unsigned short end;  /* one past the last bio_vec to verify */
+};
+
 struct verity_config {
 	struct dm_dev *dev;
 	sector_t start;
@@ -145,9 +198,21 @@ struct verity_config {
 	sector_t hash_start;
 
 	struct dm_bht bht;
+	/* Block following the last read, used to detect sequential access */
+	u64 next_block;
+
+	/* Bitmap of blocks which have already passed verification.  Only
+	 * the first verified_blocks blocks are tracked; it drops to 0 for
+	 * good once any verification fails.
+	 */
+	unsigned long *verified;
+	u64 verified_blocks;
+	size_t verified_bytes;
 
 	/* Pool required for io contexts */
 	mempool_t *io_pool;
+	/* Pool for splitting verification of an io across CPUs */
+	mempool_t *slice_pool;
 	/* Pool and bios required for making sure that backing device reads are
 	 * in PAGE_SIZE increments.
 	 */
@@ -161,6 +226,7 @@ struct verity_config {
 };
 
 static struct kmem_cache *_verity_io_pool;
+static struct kmem_cache *_verity_slice_pool;
 static struct workqueue_struct *kveritydq, *kverityd_ioq;
 
 static void kverityd_verify(struct work_struct *work);
@@ -208,6 +274,27 @@ void verity_stats_total_requests_inc(struct verity_config *vc)
 	vc->stats.total_requests++;
 }
 
+void verity_stats_total_verify_slices_inc(struct verity_config *vc)
+{
+	vc->stats.total_verify_slices++;
+}
+
+void verity_stats_total_bht_prefetches_inc(struct verity_config *vc)
+{
+	vc->stats.total_bht_prefetches++;
+}
+
+void verity_stats_total_bht_prefetch_hits_inc(struct verity_config *vc)
+{
+	vc->stats.total_bht_prefetch_hits++;
+}
+
+void verity_stats_total_verified_hits_add(struct verity_config *vc,
+					  unsigned int count)
+{
+	vc->stats.total_verified_hits += count;
+}
+
 void verity_stats_average_requeues(struct verity_config *vc, int requeues)
 {
 	/* TODO(wad) */
@@ -589,6 +676,10 @@ static void verity_dec_pending(struct dm_verity_io *io)
 	if (!atomic_dec_and_test(&io->pending))
 		goto done;
 
+	/* Readahead has nobody waiting on it. */
+	if (io->flags & VERITY_IOFLAGS_PREFETCH)
+		goto prefetch_done;
+
 	if (unlikely(io->error))
 		goto io_error;
 
@@ -611,41 +702,137 @@ static void verity_dec_pending(struct dm_verity_io *io)
 done:
 	return;
 
+prefetch_done:
+	kmem_cache_free(_verity_io_pool, io);
+	return;
+
 io_error:
 	verity_return_bio_to_caller(io);
 }
 
-/* Walks the data set and computes the hash of the data read from the
- * untrusted source device.  The computed hash is then passed to dm-bht
- * for verification.
+/*-----------------------------------------------
+ * Verified block bitmap
+ *-----------------------------------------------*/
+
+static int verity_verified_create(struct verity_config *vc, u64 blocks)
+{
+	size_t bytes = BITS_TO_LONGS(blocks) * sizeof(long);
+	size_t max_bytes = (size_t)verified_cache_kb << 10;
+
+	if (!max_bytes)
+		return 0;
+	if (bytes > max_bytes) {
+		bytes = max_bytes & ~(sizeof(long) - 1);
+		blocks = (u64)bytes * BITS_PER_BYTE;
+	}
+	if (!bytes)
+		return 0;
+
+	ALLOCTRACE("verified bitmap for %llu blocks", ULL(blocks));
+	vc->verified = vzalloc(bytes);
+	if (!vc->verified)
+		return -ENOMEM;
+	vc->verified_bytes = bytes;
+	vc->verified_blocks = blocks;
+	return 0;
+}
+
+/* Returns how many of the @count blocks starting at @block are in the
+ * given @verified state, counting from @block up to the first block which
+ * is not.
+ */
+static unsigned int verity_verified_run(struct verity_config *vc, u64 block,
+					unsigned int count, bool verified)
+{
+	u64 tracked = ACCESS_ONCE(vc->verified_blocks);
+	unsigned long end, next;
+
+	if (block >= tracked)
+		return verified ? 0 : count;
+
+	end = min(block + count, tracked);
+	if (verified)
+		next = find_next_zero_bit(vc->verified, end, block);
+	else
+		next = find_next_bit(vc->verified, end, block);
+	/* Blocks past the end of the bitmap are never known good. */
+	if (!verified && next == end)
+		return count;
+	return next - block;
+}
+
+static void verity_verified_mark(struct verity_config *vc, u64 block,
+				 unsigned int count)
+{
+	u64 end = min(block + count, ACCESS_ONCE(vc->verified_blocks));
+
+	for (; block < end; block++)
+		set_bit(block, vc->verified);
+}
+
+/* Once anything fails to verify, nothing verified earlier is trusted.
+ * Lookups stop first, so a late verity_verified_mark() racing with the
+ * clear is harmless.
+ */
+static void verity_verified_invalidate(struct verity_config *vc)
+{
+	if (!vc->verified_blocks)
+		return;
+	DMWARN("verification failed: disabling verified block bitmap");
+	vc->verified_blocks = 0;
+	smp_wmb();
+	memset(vc->verified, 0, vc->verified_bytes);
+}
+
+/* Walks the bio_vecs [idx, end) of the data set and computes the hash of
+ * the data read from the untrusted source device.  Each run of blocks not
+ * already known good is handed to dm-bht at once so that blocks sharing a
+ * page of hashes are checked in a single pass.
  */
 static int verity_verify(struct verity_config *vc,
-			 struct bio *bio)
+			 struct bio *bio, unsigned int idx, unsigned int end)
 {
-	unsigned int idx;
+	unsigned int i;
 	u64 block;
 	int r;
 
 	VERITY_BUG_ON(bio == NULL);
 
 	block = to_bytes(bio->bi_sector) >> VERITY_BLOCK_SHIFT;
+	block += idx - bio->bi_idx;
 
-	for (idx = bio->bi_idx; idx < bio->bi_vcnt; idx++) {
-		struct bio_vec *bv = bio_iovec_idx(bio, idx);
+	for (i = idx; i < end; i++) {
+		struct bio_vec *bv = bio_iovec_idx(bio, i);
 
+		/* TODO(msb) handle case where multiple blocks fit in a page */
 		VERITY_BUG_ON(bv->bv_offset % VERITY_BLOCK_SIZE);
-		VERITY_BUG_ON(bv->bv_len % VERITY_BLOCK_SIZE);
+		VERITY_BUG_ON(bv->bv_len != VERITY_BLOCK_SIZE);
+	}
+
+	while (idx < end) {
+		unsigned int run;
+
+		run = verity_verified_run(vc, block, end - idx, true);
+		if (run) {
+			verity_stats_total_verified_hits_add(vc, run);
+			REQTRACE("Blocks %llu-%llu already verified",
+				 ULL(block), ULL(block + run - 1));
+			idx += run;
+			block += run;
+			continue;
+		}
 
-		DMDEBUG("Updating hash for block %llu", ULL(block));
+		run = verity_verified_run(vc, block, end - idx, false);
+		DMDEBUG("Updating hash for blocks %llu-%llu", ULL(block),
+			ULL(block + run - 1));
 
-		/* TODO(msb) handle case where multiple blocks fit in a page */
-		r = dm_bht_verify_block(&vc->bht, block,
-					bv->bv_page, bv->bv_offset);
+		r = dm_bht_verify_range(&vc->bht, block,
+					bio_iovec_idx(bio, idx), run);
 		/* dm_bht functions aren't expected to return errno friendly
 		 * values.  They are converted here for uniformity.
 		 */
 		if (r > 0) {
-			DMERR("Pending data for block %llu seen at verify",
+			DMERR("Pending data for block %llu+ seen at verify",
 			      ULL(block));
 			r = -EBUSY;
 			goto bad_state;
@@ -655,23 +842,69 @@ static int verity_verify(struct verity_config *vc,
 			r = -EACCES;
 			goto bad_match;
 		}
-		REQTRACE("Block %llu verified", ULL(block));
+		REQTRACE("Blocks %llu-%llu verified", ULL(block),
+			 ULL(block + run - 1));
 
-		block++;
-		/* After completing a block, allow a reschedule.
-		 * TODO(wad) determine if this is truly needed.
-		 */
-		cond_resched();
+		verity_verified_mark(vc, block, run);
+		idx += run;
+		block += run;
 	}
 
 	return 0;
 
 bad_state:
 bad_match:
+	verity_verified_invalidate(vc);
 	return r;
 }
 
-/* Services the verify workqueue */
+/* Called as each slice of an io finishes hashing.  The first error seen
+ * sticks and the last slice returns the bio to the caller.
+ */
+static void verity_verify_done(struct dm_verity_io *io, int error)
+{
+	struct verity_config *vc = io->target->private;
+
+	if (unlikely(error))
+		cmpxchg(&io->error, 0, error);
+
+	if (!atomic_dec_and_test(&io->verify_pending))
+		return;
+
+	/* Free up the bio and tag with the return value */
+	verity_stats_verify_queue_dec(vc);
+	verity_return_bio_to_caller(io);
+}
+
+/* Services slices of an io queued to this CPU by kverityd_verify. */
+static void kverityd_verify_slice(struct work_struct *work)
+{
+	struct dm_verity_slice *slice = container_of(work,
+						     struct dm_verity_slice,
+						     work);
+	struct dm_verity_io *io = slice->io;
+	struct verity_config *vc = io->target->private;
+	int r;
+
+	r = verity_verify(vc, io->bio, slice->idx, slice->end);
+	mempool_free(slice, vc->slice_pool);
+	verity_verify_done(io, r);
+}
+
+static unsigned int verity_verify_cpus(void)
+{
+	unsigned int online = num_online_cpus();
+
+	if (!verify_cpus || verify_cpus > online)
+		return online;
+	return verify_cpus;
+}
+
+/* Services the verify workqueue.  This runs on the CPU which completed the
+ * last I/O for the request.  Large requests are cut into slices which are
+ * hashed in parallel on the neighboring online CPUs using dm-bht's per-CPU
+ * hash descriptors, while the first slice is hashed right here.
+ */
 static void kverityd_verify(struct work_struct *work)
 {
 	struct delayed_work *dwork = container_of(work, struct delayed_work,
@@ -679,12 +912,44 @@ static void kverityd_verify(struct work_struct *work)
 	struct dm_verity_io *io = container_of(dwork, struct dm_verity_io,
 					       work);
 	struct verity_config *vc = io->target->private;
+	struct bio *bio = io->bio;
+	unsigned int nr_vecs = bio->bi_vcnt - bio->bi_idx;
+	unsigned int per_cpu, idx, end;
+	int cpu = smp_processor_id();
+	int r;
 
-	io->error = verity_verify(vc, io->bio);
+	per_cpu = max(DIV_ROUND_UP(nr_vecs, verity_verify_cpus()),
+		      max(verify_batch, 1U));
+	end = min(bio->bi_idx + per_cpu, (unsigned int)bio->bi_vcnt);
 
-	/* Free up the bio and tag with the return value */
-	verity_stats_verify_queue_dec(vc);
-	verity_return_bio_to_caller(io);
+	/* This reference is dropped once the local slice is done. */
+	atomic_set(&io->verify_pending, 1);
+
+	for (idx = end; idx < bio->bi_vcnt; idx += per_cpu) {
+		struct dm_verity_slice *slice;
+
+		/* Never wait here: on failure the rest is verified locally */
+		slice = mempool_alloc(vc->slice_pool, GFP_NOWAIT);
+		if (unlikely(!slice))
+			break;
+		slice->io = io;
+		slice->idx = idx;
+		slice->end = min(idx + per_cpu, (unsigned int)bio->bi_vcnt);
+		INIT_WORK(&slice->work, kverityd_verify_slice);
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+
+		atomic_inc(&io->verify_pending);
+		verity_stats_total_verify_slices_inc(vc);
+		queue_work_on(cpu, kveritydq, &slice->work);
+	}
+
+	r = verity_verify(vc, bio, bio->bi_idx, end);
+	if (!r && idx < bio->bi_vcnt)
+		r = verity_verify(vc, bio, idx, bio->bi_vcnt);
+	verity_verify_done(io, r);
 }
 
 /* Asynchronously called upon the completion of dm-bht I/O.  The status
@@ -713,8 +978,12 @@ static void kverityd_io_bht_populate_end(struct bio *bio, int error)
 
 	/* We bail but assume the tree has been marked bad. */
 	if (unlikely(error)) {
-		DMERR("Failed to read for sector %llu (%u)",
-		      ULL(io->bio->bi_sector), io->bio->bi_size);
+		if (io->bio)
+			DMERR("Failed to read for sector %llu (%u)",
+			      ULL(io->bio->bi_sector), io->bio->bi_size);
+		else
+			DMERR("Failed to prefetch hashes for block %llu",
+			      ULL(io->block));
 		io->error = error;
 		/* Pass through the error to verity_dec_pending below */
 	}
@@ -805,6 +1074,54 @@ static void kverityd_io_bht_populate(struct dm_verity_io *io)
 		 ULL(io->block), atomic_read(&io->pending) - 1, io);
 }
 
+/* Reads in the hash tree entries the next bht_readahead leaf entries past
+ * @io will need, along with any missing parents.  The reads are issued
+ * alongside the data and hash I/O of @io, but are tracked by their own
+ * dm_verity_io so that @io never waits on them.
+ */
+static void kverityd_io_bht_prefetch(struct dm_verity_io *io)
+{
+	struct verity_config *vc = io->target->private;
+	struct dm_bht *bht = &vc->bht;
+	struct dm_verity_io *pio;
+	u64 block = ALIGN(io->block + io->count, bht->node_count);
+	u64 end = block + (u64)bht_readahead * bht->node_count;
+
+	if (end > bht->block_count)
+		end = bht->block_count;
+
+	for (; block < end; block += bht->node_count) {
+		if (dm_bht_is_populated(bht, block))
+			continue;
+
+		/*
+		 * Straight from the slab: the io_pool reserve is kept for
+		 * demand reads, which must not wait behind readahead.
+		 */
+		pio = kmem_cache_alloc(_verity_io_pool,
+				       GFP_NOWAIT | __GFP_NOWARN);
+		if (!pio)
+			return;
+		pio->flags = VERITY_IOFLAGS_PREFETCH;
+		pio->target = io->target;
+		pio->bio = NULL;
+		pio->sector = 0;
+		pio->error = 0;
+		pio->block = block;
+		pio->count = 0;
+		atomic_set(&pio->pending, 1);
+
+		REQTRACE("prefetching hashes for block %llu (io:%p)",
+			 ULL(block), io);
+		if (dm_bht_populate(bht, pio, block) < 0)
+			DMERR_LIMIT("bht prefetch failed for block %llu",
+				    ULL(block));
+		else if (atomic_read(&pio->pending) > 1)
+			verity_stats_total_bht_prefetches_inc(vc);
+		verity_dec_pending(pio);
+	}
+}
+
 /* Asynchronously called upon the completion of I/O issued
  * from kverityd_src_io_read. verity_dec_pending() acts as
  * the scheduler/flow manager.
@@ -882,12 +1199,33 @@ static void kverityd_io(struct work_struct *work)
 						  work);
 	struct dm_verity_io *io = container_of(dwork, struct dm_verity_io,
 					       work);
+	struct verity_config *vc = io->target->private;
+	bool sequential = false;
+
 	VERITY_BUG_ON(!io->bio);
 
+	/* Only the first pass of an io counts towards readahead.  A
+	 * sequential io which crosses into a new leaf entry would have
+	 * stalled on hash I/O had readahead not already loaded it.
+	 */
+	if (!(io->flags & VERITY_IOFLAGS_CLONED) && bht_readahead) {
+		unsigned int shift = vc->bht.node_count_shift;
+
+		sequential = (io->block && io->block == vc->next_block);
+		vc->next_block = io->block + io->count;
+		if (sequential &&
+		    ((io->block - 1) >> shift) !=
+		    ((io->block + io->count - 1) >> shift) &&
+		    verity_is_bht_populated(io))
+			verity_stats_total_bht_prefetch_hits_inc(vc);
+	}
+
 	/* Issue requests asynchronously. */
 	verity_inc_pending(io);
 	kverityd_src_io_read(io);
 	kverityd_io_bht_populate(io);
+	if (sequential)
+		kverityd_io_bht_prefetch(io);
 	verity_dec_pending(io);
 }
 
@@ -1163,6 +1501,19 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_slab_pool;
 	}
 
+	/* Pool for the per-CPU verification slices of an io */
+	ALLOCTRACE("slab pool for verify slices");
+	vc->slice_pool = mempool_create_slab_pool(MIN_IOS, _verity_slice_pool);
+	if (!vc->slice_pool) {
+		ti->error = "Cannot allocate verity slice mempool";
+		goto bad_slice_pool;
+	}
+
+	if (verity_verified_create(vc, blocks)) {
+		ti->error = "Cannot allocate verified block bitmap";
+		goto bad_verified;
+	}
+
 	/* Allocate the bioset used for request padding */
 	/* TODO(wad) allocate a separate bioset for the first verify maybe */
 	ALLOCTRACE("bioset for I/O reqs");
@@ -1186,6 +1537,10 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	return 0;
 
 bad_bs:
+	vfree(vc->verified);
+bad_verified:
+	mempool_destroy(vc->slice_pool);
+bad_slice_pool:
 	mempool_destroy(vc->io_pool);
 bad_slab_pool:
 bad_err_behavior:
@@ -1207,6 +1562,9 @@ static void verity_dtr(struct dm_target *ti)
 
 	DMDEBUG("Destroying bs");
 	bioset_free(vc->bs);
+	vfree(vc->verified);
+	DMDEBUG("Destroying slice_pool");
+	mempool_destroy(vc->slice_pool);
 	DMDEBUG("Destroying io_pool");
 	mempool_destroy(vc->io_pool);
 
@@ -1233,12 +1591,17 @@ static int verity_status(struct dm_target *ti, status_type_t type,
 
 	switch (type) {
 	case STATUSTYPE_INFO:
-		DMEMIT("%u %u %u %u %llu",
+		DMEMIT("%u %u %u %u %llu %llu %llu %llu %llu %lu",
 		       vc->stats.io_queue,
 		       vc->stats.verify_queue,
 		       vc->stats.average_requeues,
 		       vc->stats.total_requeues,
-		       vc->stats.total_requests);
+		       vc->stats.total_requests,
+		       vc->stats.total_verify_slices,
+		       vc->stats.total_bht_prefetches,
+		       vc->stats.total_bht_prefetch_hits,
+		       vc->stats.total_verified_hits,
+		       (unsigned long)vc->verified_bytes);
 		break;
 
 	case STATUSTYPE_TABLE:
@@ -1313,6 +1676,12 @@ static int __init dm_verity_init(void)
 		goto bad_io_pool;
 	}
 
+	_verity_slice_pool = KMEM_CACHE(dm_verity_slice, 0);
+	if (!_verity_slice_pool) {
+		DMERR("failed to allocate pool dm_verity_slice");
+		goto bad_slice_pool;
+	}
+
 	kverityd_ioq = alloc_workqueue("kverityd_io", VERITY_WQ_FLAGS, 1);
 	if (!kverityd_ioq) {
 		DMERR("failed to create workqueue kverityd_ioq");
@@ -1341,6 +1710,8 @@ register_failed:
 bad_verify_queue:
 	destroy_workqueue(kverityd_ioq);
 bad_io_queue:
+	kmem_cache_destroy(_verity_slice_pool);
+bad_slice_pool:
 	kmem_cache_destroy(_verity_io_pool);
 bad_io_pool:
 	return r;
@@ -1352,6 +1723,7 @@ static void __exit dm_verity_exit(void)
 	destroy_workqueue(kverityd_ioq);
 
 	dm_unregister_target(&verity_target);
+	kmem_cache_destroy(_verity_slice_pool);
 	kmem_cache_destroy(_verity_io_pool);
 }
 
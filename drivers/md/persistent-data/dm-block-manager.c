@@ -9,6 +9,7 @@
 #include <linux/dm-io.h>
 #include <linux/slab.h>
 #include <linux/device-mapper.h>
+#include <linux/workqueue.h>
 
 #define DM_MSG_PREFIX "block manager"
 
@@ -17,6 +18,15 @@
 #define SECTOR_SIZE (1 << SECTOR_SHIFT)
 #define MAX_CACHE_SIZE 16U
 
+/*
+ * Dirty blocks are written back in the background once they have been
+ * dirty for WRITEBACK_DELAY, or straight away once a quarter of the
+ * cache is dirty, so that commits find little left to write.
+ */
+#define WRITEBACK_DELAY HZ
+
+static struct workqueue_struct *dm_bm_wq;
+
 enum dm_block_state {
 	BS_EMPTY,
 	BS_CLEAN,
@@ -77,6 +87,15 @@ struct dm_block_manager {
 	unsigned available_count;
 	unsigned reading_count;
 	unsigned writing_count;
+	unsigned dirty_count;
+	unsigned allocated_count;	/* Blocks, which the shrinker may free */
+
+	uint64_t hits;
+	uint64_t misses;
+
+	struct delayed_work writeback;
+	struct work_struct writeback_now;
+	struct shrinker shrinker;
 
 	struct list_head empty_list;	/* No block assigned */
 	struct list_head clean_list;	/* Unlocked and clean */
@@ -204,6 +223,7 @@ static void __transition(struct dm_block *b, enum dm_block_state new_state)
 		/* DOT: dirty -> writing */
 		BUG_ON(!(b->state == BS_DIRTY));
 		list_del(&b->list);
+		bm->dirty_count--;
 		bm->writing_count++;
 		break;
 
@@ -218,6 +238,7 @@ static void __transition(struct dm_block *b, enum dm_block_state new_state)
 		/* DOT: dirty -> read_locked_dirty */
 		BUG_ON(!((b->state == BS_DIRTY)));
 		list_del(&b->list);
+		bm->dirty_count--;
 		break;
 
 	case BS_WRITE_LOCKED:
@@ -229,6 +250,8 @@ static void __transition(struct dm_block *b, enum dm_block_state new_state)
 
 		if (b->state == BS_CLEAN)
 			bm->available_count--;
+		else
+			bm->dirty_count--;
 		break;
 
 	case BS_DIRTY:
@@ -237,6 +260,7 @@ static void __transition(struct dm_block *b, enum dm_block_state new_state)
 		BUG_ON(!((b->state == BS_WRITE_LOCKED) ||
 			 (b->state == BS_READ_LOCKED_DIRTY)));
 		list_add_tail(&b->list, &bm->dirty_list);
+		bm->dirty_count++;
 		break;
 
 	case BS_ERROR:
@@ -353,6 +377,35 @@ static void write_all_dirty(struct dm_block_manager *bm)
 	write_dirty(bm, bm->cache_size);
 }
 
+static void do_writeback(struct work_struct *ws)
+{
+	struct dm_block_manager *bm =
+		container_of(to_delayed_work(ws), struct dm_block_manager,
+			     writeback);
+
+	write_all_dirty(bm);
+}
+
+static void do_writeback_now(struct work_struct *ws)
+{
+	struct dm_block_manager *bm =
+		container_of(ws, struct dm_block_manager, writeback_now);
+
+	write_all_dirty(bm);
+}
+
+/*
+ * Called as a block goes back on the dirty list.  Assumes bm->lock is
+ * held.
+ */
+static void __kick_writeback(struct dm_block_manager *bm)
+{
+	if (bm->dirty_count >= bm->cache_size / 4)
+		queue_work(dm_bm_wq, &bm->writeback_now);
+	else
+		queue_delayed_work(dm_bm_wq, &bm->writeback, WRITEBACK_DELAY);
+}
+
 static void __clear_errors(struct dm_block_manager *bm)
 {
 	struct dm_block *b, *tmp;
@@ -444,6 +497,8 @@ static int __wait_clean(struct dm_block_manager *bm, unsigned long *flags)
 /*----------------------------------------------------------------
  * Finding a free block to recycle
  *--------------------------------------------------------------*/
+static struct dm_block *alloc_block(struct dm_block_manager *bm, gfp_t gfp);
+
 static int recycle_block(struct dm_block_manager *bm, dm_block_t where,
 			 int need_read, struct dm_block_validator *v,
 			 struct dm_block **result)
@@ -473,7 +528,28 @@ static int recycle_block(struct dm_block_manager *bm, dm_block_t where,
 			b = list_first_entry(&bm->empty_list, struct dm_block, list);
 			break;
 
-		} else if (!list_empty(&bm->clean_list)) {
+		} else if (bm->allocated_count < bm->cache_size) {
+			/*
+			 * The shrinker has taken blocks from us, get one
+			 * back rather than evicting.
+			 */
+			spin_unlock_irqrestore(&bm->lock, flags);
+			b = alloc_block(bm, GFP_NOIO);
+			spin_lock_irqsave(&bm->lock, flags);
+
+			if (b) {
+				list_add(&b->list, &bm->empty_list);
+				bm->allocated_count++;
+				bm->available_count++;
+				continue;
+			}
+		}
+
+		/*
+		 * The clean list is in least recently used order: blocks
+		 * are added to its tail as they are unlocked.
+		 */
+		if (!list_empty(&bm->clean_list)) {
 			b = list_first_entry(&bm->clean_list, struct dm_block, list);
 			__transition(b, BS_EMPTY);
 			break;
@@ -532,9 +608,9 @@ static int recycle_block(struct dm_block_manager *bm, dm_block_t where,
 
 static struct kmem_cache *dm_block_cache;  /* struct dm_block */
 
-static struct dm_block *alloc_block(struct dm_block_manager *bm)
+static struct dm_block *alloc_block(struct dm_block_manager *bm, gfp_t gfp)
 {
-	struct dm_block *b = kmem_cache_alloc(dm_block_cache, GFP_KERNEL);
+	struct dm_block *b = kmem_cache_alloc(dm_block_cache, gfp);
 
 	if (!b)
 		return NULL;
@@ -542,7 +618,7 @@ static struct dm_block *alloc_block(struct dm_block_manager *bm)
 	INIT_LIST_HEAD(&b->list);
 	INIT_HLIST_NODE(&b->hlist);
 
-	b->data = kmem_cache_alloc(bm->buffer_cache, GFP_KERNEL);
+	b->data = kmem_cache_alloc(bm->buffer_cache, gfp);
 	if (!b->data) {
 		kmem_cache_free(dm_block_cache, b);
 		return NULL;
@@ -571,7 +647,7 @@ static int populate_bm(struct dm_block_manager *bm, unsigned count)
 	LIST_HEAD(bs);
 
 	for (i = 0; i < count; i++) {
-		struct dm_block *b = alloc_block(bm);
+		struct dm_block *b = alloc_block(bm, GFP_KERNEL);
 		if (!b) {
 			struct dm_block *tmp;
 			list_for_each_entry_safe(b, tmp, &bs, list)
@@ -584,10 +660,52 @@ static int populate_bm(struct dm_block_manager *bm, unsigned count)
 
 	list_replace(&bs, &bm->empty_list);
 	bm->available_count = count;
+	bm->allocated_count = count;
 
 	return 0;
 }
 
+/*
+ * Frees unused blocks, empty ones first and then clean ones in least
+ * recently used order, but never shrinks the cache below MAX_CACHE_SIZE
+ * blocks.  Dirty blocks are left to the background writeback.
+ */
+static int bm_shrink(struct shrinker *shrinker, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct dm_block_manager *bm =
+		container_of(shrinker, struct dm_block_manager, shrinker);
+	struct dm_block *b, *tmp;
+	unsigned long flags;
+	LIST_HEAD(victims);
+	int r = 0;
+
+	spin_lock_irqsave(&bm->lock, flags);
+	while (nr_to_scan-- > 0 && bm->allocated_count > MAX_CACHE_SIZE) {
+		if (!list_empty(&bm->empty_list))
+			b = list_first_entry(&bm->empty_list, struct dm_block, list);
+
+		else if (!list_empty(&bm->clean_list)) {
+			b = list_first_entry(&bm->clean_list, struct dm_block, list);
+			__transition(b, BS_EMPTY);
+
+		} else
+			break;
+
+		list_move(&b->list, &victims);
+		bm->available_count--;
+		bm->allocated_count--;
+	}
+
+	if (bm->allocated_count > MAX_CACHE_SIZE)
+		r = min(bm->available_count, bm->allocated_count - MAX_CACHE_SIZE);
+	spin_unlock_irqrestore(&bm->lock, flags);
+
+	list_for_each_entry_safe(b, tmp, &victims, list)
+		free_block(b);
+
+	return r;
+}
+
 /*----------------------------------------------------------------
  * Public interface
  *--------------------------------------------------------------*/
@@ -630,6 +748,12 @@ struct dm_block_manager *dm_block_manager_create(struct block_device *bdev,
 	bm->available_count = 0;
 	bm->reading_count = 0;
 	bm->writing_count = 0;
+	bm->dirty_count = 0;
+	bm->allocated_count = 0;
+	bm->hits = 0;
+	bm->misses = 0;
+	INIT_DELAYED_WORK(&bm->writeback, do_writeback);
+	INIT_WORK(&bm->writeback_now, do_writeback_now);
 
 	sprintf(bm->buffer_cache_name, "dm_block_buffer-%d-%d",
 		MAJOR(disk_devt(bdev->bd_disk)),
@@ -653,6 +777,10 @@ struct dm_block_manager *dm_block_manager_create(struct block_device *bdev,
 	if (populate_bm(bm, cache_size) < 0)
 		goto bad_io_client;
 
+	bm->shrinker.shrink = bm_shrink;
+	bm->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&bm->shrinker);
+
 	return bm;
 
 bad_io_client:
@@ -669,9 +797,18 @@ EXPORT_SYMBOL_GPL(dm_block_manager_create);
 void dm_block_manager_destroy(struct dm_block_manager *bm)
 {
 	int i;
+	unsigned long flags;
 	struct dm_block *b, *btmp;
 	struct hlist_node *n, *tmp;
 
+	unregister_shrinker(&bm->shrinker);
+	cancel_delayed_work_sync(&bm->writeback);
+	cancel_work_sync(&bm->writeback_now);
+
+	spin_lock_irqsave(&bm->lock, flags);
+	__wait_all_io(bm, &flags);
+	spin_unlock_irqrestore(&bm->lock, flags);
+
 	dm_io_client_destroy(bm->io);
 
 	for (i = 0; i < bm->hash_size; i++)
@@ -698,6 +835,17 @@ dm_block_t dm_bm_nr_blocks(struct dm_block_manager *bm)
 	return bm->nr_blocks;
 }
 
+void dm_bm_get_stats(struct dm_block_manager *bm, struct dm_bm_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bm->lock, flags);
+	stats->hits = bm->hits;
+	stats->misses = bm->misses;
+	spin_unlock_irqrestore(&bm->lock, flags);
+}
+EXPORT_SYMBOL_GPL(dm_bm_get_stats);
+
 static int lock_internal(struct dm_block_manager *bm, dm_block_t block,
 			 int how, int need_read, int can_block,
 			 struct dm_block_validator *v,
@@ -711,6 +859,7 @@ static int lock_internal(struct dm_block_manager *bm, dm_block_t block,
 retry:
 	b = __find_block(bm, block);
 	if (b) {
+		bm->hits++;
 		if (!need_read)
 			b->validator = v;
 		else {
@@ -773,6 +922,7 @@ retry:
 		goto out;
 
 	} else {
+		bm->misses++;
 		spin_unlock_irqrestore(&bm->lock, flags);
 		r = recycle_block(bm, block, need_read, v, &b);
 		spin_lock_irqsave(&bm->lock, flags);
@@ -847,6 +997,7 @@ int dm_bm_unlock(struct dm_block *b)
 	switch (b->state) {
 	case BS_WRITE_LOCKED:
 		__transition(b, BS_DIRTY);
+		__kick_writeback(b->bm);
 		wake_up(&b->io_q);
 		break;
 
@@ -860,6 +1011,7 @@ int dm_bm_unlock(struct dm_block *b)
 	case BS_READ_LOCKED_DIRTY:
 		if (!--b->read_lock_count) {
 			__transition(b, BS_DIRTY);
+			__kick_writeback(b->bm);
 			wake_up(&b->io_q);
 		}
 		break;
@@ -949,11 +1101,18 @@ static int __init init_persistent_data(void)
 	if (!dm_block_cache)
 		return -ENOMEM;
 
+	dm_bm_wq = alloc_workqueue("dm-block-manager", WQ_MEM_RECLAIM, 0);
+	if (!dm_bm_wq) {
+		kmem_cache_destroy(dm_block_cache);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
 static void __exit exit_persistent_data(void)
 {
+	destroy_workqueue(dm_bm_wq);
 	kmem_cache_destroy(dm_block_cache);
 }
 
@@ -43,6 +43,17 @@ void dm_block_manager_destroy(struct dm_block_manager *bm);
 unsigned dm_bm_block_size(struct dm_block_manager *bm);
 dm_block_t dm_bm_nr_blocks(struct dm_block_manager *bm);
 
+/*
+ * Counts of lock requests that found their block in the cache (hits)
+ * and that had to read or zero a recycled block (misses).
+ */
+struct dm_bm_stats {
+	uint64_t hits;
+	uint64_t misses;
+};
+
+void dm_bm_get_stats(struct dm_block_manager *bm, struct dm_bm_stats *stats);
+
 /*----------------------------------------------------------------*/
 
 /*
@@ -193,6 +193,22 @@ static int stripe_operations_active(struct stripe_head *sh)
 	       test_bit(STRIPE_COMPUTE_RUN, &sh->state);
 }
 
+static struct workqueue_struct *raid5_wq;
+
+/* Hand a stripe to the worker selected by the cpu that activated it and
+ * run that worker on the same cpu.  Called with device_lock held.
+ */
+static void raid5_wakeup_worker(raid5_conf_t *conf, struct stripe_head *sh)
+{
+	struct r5worker *worker = &conf->workers[sh->cpu % conf->worker_cnt];
+
+	list_add_tail(&sh->lru, &worker->handle_list);
+	if (cpu_online(sh->cpu))
+		queue_work_on(sh->cpu, raid5_wq, &worker->work);
+	else
+		queue_work(raid5_wq, &worker->work);
+}
+
 static void __release_stripe(raid5_conf_t *conf, struct stripe_head *sh)
 {
 	if (atomic_dec_and_test(&sh->count)) {
@@ -206,6 +222,10 @@ static void __release_stripe(raid5_conf_t *conf, struct stripe_head *sh)
 				   sh->bm_seq - conf->seq_write > 0) {
 				list_add_tail(&sh->lru, &conf->bitmap_list);
 				plugger_set_plug(&conf->plug);
+			} else if (conf->worker_cnt) {
+				clear_bit(STRIPE_BIT_DELAY, &sh->state);
+				raid5_wakeup_worker(conf, sh);
+				return;
 			} else {
 				clear_bit(STRIPE_BIT_DELAY, &sh->state);
 				list_add_tail(&sh->lru, &conf->handle_list);
@@ -332,7 +352,7 @@ static void init_stripe(struct stripe_head *sh, sector_t sector, int previous)
 	sh->sector = sector;
 	stripe_set_idx(sector, conf, previous, sh);
 	sh->state = 0;
-
+	sh->cpu = smp_processor_id();
 
 	for (i = sh->disks; i--; ) {
 		struct r5dev *dev = &sh->dev[i];
@@ -3935,19 +3955,24 @@ static int chunk_aligned_read(mddev_t *mddev, struct bio * raid_bio)
  * stripe with in flight i/o.  The bypass_count will be reset when the
  * head of the hold_list has changed, i.e. the head was promoted to the
  * handle_list.
+ *
+ * raid5d passes conf->handle_list, stripe workers pass their own list.  The
+ * hold_list is shared, so preread stripes are picked up by whoever runs
+ * first.
  */
-static struct stripe_head *__get_priority_stripe(raid5_conf_t *conf)
+static struct stripe_head *__get_priority_stripe(raid5_conf_t *conf,
+						  struct list_head *handle_list)
 {
 	struct stripe_head *sh;
 
 	pr_debug("%s: handle: %s hold: %s full_writes: %d bypass_count: %d\n",
 		  __func__,
-		  list_empty(&conf->handle_list) ? "empty" : "busy",
+		  list_empty(handle_list) ? "empty" : "busy",
 		  list_empty(&conf->hold_list) ? "empty" : "busy",
 		  atomic_read(&conf->pending_full_writes), conf->bypass_count);
 
-	if (!list_empty(&conf->handle_list)) {
-		sh = list_entry(conf->handle_list.next, typeof(*sh), lru);
+	if (!list_empty(handle_list)) {
+		sh = list_entry(handle_list->next, typeof(*sh), lru);
 
 		if (list_empty(&conf->hold_list))
 			conf->bypass_count = 0;
@@ -4551,7 +4576,7 @@ static void raid5d(mddev_t *mddev)
 			handled++;
 		}
 
-		sh = __get_priority_stripe(conf);
+		sh = __get_priority_stripe(conf, &conf->handle_list);
 
 		if (!sh)
 			break;
@@ -4574,6 +4599,64 @@ static void raid5d(mddev_t *mddev)
 	pr_debug("--- raid5d inactive\n");
 }
 
+/*
+ * Stripe worker.  Handles the stripes assigned to it (and any ready
+ * preread stripes) in parallel with raid5d, which keeps the bitmap,
+ * aligned read retry and recovery work to itself.
+ */
+static void raid5_do_work(struct work_struct *work)
+{
+	struct r5worker *worker = container_of(work, struct r5worker, work);
+	raid5_conf_t *conf = worker->conf;
+	struct stripe_head *sh;
+	int handled = 0;
+
+	spin_lock_irq(&conf->device_lock);
+	while ((sh = __get_priority_stripe(conf, &worker->handle_list))) {
+		spin_unlock_irq(&conf->device_lock);
+
+		handled++;
+		handle_stripe(sh);
+		release_stripe(sh);
+		cond_resched();
+
+		spin_lock_irq(&conf->device_lock);
+	}
+	spin_unlock_irq(&conf->device_lock);
+	pr_debug("%d stripes handled by worker\n", handled);
+
+	if (handled) {
+		async_tx_issue_pending_all();
+		unplug_slaves(conf->mddev);
+	}
+}
+
+static void free_workers(raid5_conf_t *conf, struct r5worker *workers,
+			 int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		cancel_work_sync(&workers[i].work);
+	kfree(workers);
+}
+
+static struct r5worker *alloc_workers(raid5_conf_t *conf, int cnt)
+{
+	struct r5worker *workers;
+	int i;
+
+	workers = kcalloc(cnt, sizeof(struct r5worker), GFP_KERNEL);
+	if (!workers)
+		return NULL;
+	for (i = 0; i < cnt; i++) {
+		INIT_WORK(&workers[i].work, raid5_do_work);
+		INIT_LIST_HEAD(&workers[i].handle_list);
+		workers[i].conf = conf;
+	}
+	return workers;
+}
+
 static ssize_t
 raid5_show_stripe_cache_size(mddev_t *mddev, char *page)
 {
@@ -4669,6 +4752,64 @@ raid5_preread_bypass_threshold = __ATTR(preread_bypass_threshold,
 					raid5_show_preread_threshold,
 					raid5_store_preread_threshold);
 
+static ssize_t
+raid5_show_stripe_workers(mddev_t *mddev, char *page)
+{
+	raid5_conf_t *conf = mddev->private;
+	if (conf)
+		return sprintf(page, "%d\n", conf->worker_cnt);
+	else
+		return 0;
+}
+
+static ssize_t
+raid5_store_stripe_workers(mddev_t *mddev, const char *page, size_t len)
+{
+	raid5_conf_t *conf = mddev->private;
+	struct r5worker *workers = NULL, *old_workers;
+	unsigned long new;
+	int old_cnt;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	if (strict_strtoul(page, 10, &new))
+		return -EINVAL;
+	if (new > nr_cpu_ids)
+		return -EINVAL;
+	if (new == conf->worker_cnt)
+		return len;
+
+	if (new) {
+		workers = alloc_workers(conf, new);
+		if (!workers)
+			return -ENOMEM;
+	}
+
+	/* Quiescing drains every handle list, so no stripe can be left
+	 * on a worker that is about to go away.
+	 */
+	mddev_suspend(mddev);
+	spin_lock_irq(&conf->device_lock);
+	old_workers = conf->workers;
+	old_cnt = conf->worker_cnt;
+	conf->workers = workers;
+	conf->worker_cnt = new;
+	spin_unlock_irq(&conf->device_lock);
+	mddev_resume(mddev);
+
+	if (old_workers)
+		free_workers(conf, old_workers, old_cnt);
+	return len;
+}
+
+static struct md_sysfs_entry
+raid5_stripe_workers = __ATTR(stripe_workers, S_IRUGO | S_IWUSR,
+			      raid5_show_stripe_workers,
+			      raid5_store_stripe_workers);
+
 static ssize_t
 stripe_cache_active_show(mddev_t *mddev, char *page)
 {
@@ -4686,6 +4827,7 @@ static struct attribute *raid5_attrs[] =  {
 	&raid5_stripecache_size.attr,
 	&raid5_stripecache_active.attr,
 	&raid5_preread_bypass_threshold.attr,
+	&raid5_stripe_workers.attr,
 	NULL,
 };
 static struct attribute_group raid5_attrs_group = {
@@ -4733,6 +4875,8 @@ static void raid5_free_percpu(raid5_conf_t *conf)
 
 static void free_conf(raid5_conf_t *conf)
 {
+	if (conf->workers)
+		free_workers(conf, conf->workers, conf->worker_cnt);
 	shrink_stripes(conf);
 	raid5_free_percpu(conf);
 	kfree(conf->disks);
@@ -6033,6 +6177,10 @@ static struct mdk_personality raid4_personality =
 
 static int __init raid5_init(void)
 {
+	raid5_wq = alloc_workqueue("raid5wq", WQ_NON_REENTRANT |
+				   WQ_MEM_RECLAIM | WQ_CPU_INTENSIVE, 0);
+	if (!raid5_wq)
+		return -ENOMEM;
 	register_md_personality(&raid6_personality);
 	register_md_personality(&raid5_personality);
 	register_md_personality(&raid4_personality);
@@ -6044,6 +6192,7 @@ static void raid5_exit(void)
 	unregister_md_personality(&raid6_personality);
 	unregister_md_personality(&raid5_personality);
 	unregister_md_personality(&raid4_personality);
+	destroy_workqueue(raid5_wq);
 }
 
 module_init(raid5_init);
@@ -3,6 +3,7 @@
 
 #include <linux/raid/xor.h>
 #include <linux/dmaengine.h>
+#include <linux/workqueue.h>
 
 /*
  *
@@ -211,6 +212,8 @@ struct stripe_head {
 	atomic_t		count;	      /* nr of active thread/requests */
 	spinlock_t		lock;
 	int			bm_seq;	/* sequence number for bitmap flushes */
+	int			cpu;	/* cpu that activated the stripe, selects
+					 * the stripe worker (see r5worker) */
 	int			disks;		/* disks in stripe */
 	enum check_states	check_state;
 	enum reconstruct_states reconstruct_state;
@@ -344,6 +347,17 @@ struct disk_info {
 	mdk_rdev_t	*rdev;
 };
 
+/* A stripe worker handles stripes in parallel with raid5d.  Each stripe
+ * is assigned to a worker by the cpu that activated it, and the work is
+ * queued on that cpu, so the stripe is handled where its bios were
+ * submitted.
+ */
+struct r5worker {
+	struct work_struct	work;
+	struct list_head	handle_list; /* stripes assigned to this worker */
+	struct raid5_private_data *conf;
+};
+
 struct raid5_private_data {
 	struct hlist_head	*stripe_hashtbl;
 	mddev_t			*mddev;
@@ -384,6 +398,9 @@ struct raid5_private_data {
 	int			bypass_threshold; /* preread nice */
 	struct list_head	*last_hold; /* detect hold_list promotions */
 
+	struct r5worker		*workers; /* stripe workers, may be NULL */
+	int			worker_cnt;
+
 	atomic_t		reshape_stripes; /* stripes with pending writes for reshape */
 	/* unfortunately we need two cache names as we temporarily have
 	 * two caches.
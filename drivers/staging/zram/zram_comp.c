@@ -0,0 +1,215 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/lzo.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zram_comp.h"
+
+static int zram_lzo_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem)
+{
+	int ret = lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, workmem);
+
+	return ret == LZO_E_OK ? 0 : ret;
+}
+
+static int zram_lzo_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+	int ret = lzo1x_decompress_safe(src, src_len, dst, &dst_len);
+
+	return ret == LZO_E_OK ? 0 : ret;
+}
+
+static int zram_lz4_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem)
+{
+	return lz4_compress(src, PAGE_SIZE, dst, dst_len, workmem);
+}
+
+/*
+ * The stored object may be padded by the allocator; lz4_decompress()
+ * stops once the page is full, so the padding is never parsed.
+ */
+static int zram_lz4_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst)
+{
+	return lz4_decompress(src, &src_len, dst, PAGE_SIZE);
+}
+
+static const struct zram_compressor zram_compressors[] = {
+	{
+		.name		= "lzo",
+		.workmem_size	= LZO1X_MEM_COMPRESS,
+		.compress	= zram_lzo_compress,
+		.decompress	= zram_lzo_decompress,
+	},
+	{
+		.name		= "lz4",
+		.workmem_size	= LZ4_MEM_COMPRESS,
+		.compress	= zram_lz4_compress,
+		.decompress	= zram_lz4_decompress,
+	},
+};
+
+const struct zram_compressor *zram_find_compressor(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(zram_compressors); i++)
+		if (sysfs_streq(name, zram_compressors[i].name))
+			return &zram_compressors[i];
+
+	return NULL;
+}
+
+/*
+ * Lists the available compressors, the one in use in brackets.
+ */
+ssize_t zram_show_compressors(const struct zram_compressor *cur, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(zram_compressors); i++) {
+		if (cur == &zram_compressors[i])
+			sz += sprintf(buf + sz, "[%s] ", zram_compressors[i].name);
+		else
+			sz += sprintf(buf + sz, "%s ", zram_compressors[i].name);
+	}
+
+	/* replace the trailing space */
+	buf[sz - 1] = '\n';
+	return sz;
+}
+
+static void zram_strm_free(struct zram_strm *strm)
+{
+	kfree(strm->workmem);
+	free_pages((unsigned long)strm->buffer, 1);
+	kfree(strm);
+}
+
+static struct zram_strm *zram_strm_alloc(const struct zram_compressor *comp,
+			gfp_t flags)
+{
+	struct zram_strm *strm;
+
+	strm = kmalloc(sizeof(*strm), flags);
+	if (!strm)
+		return NULL;
+
+	strm->workmem = kzalloc(comp->workmem_size, flags);
+	strm->buffer = (void *)__get_free_pages(flags | __GFP_ZERO, 1);
+	if (!strm->workmem || !strm->buffer) {
+		zram_strm_free(strm);
+		return NULL;
+	}
+
+	return strm;
+}
+
+/*
+ * Sets up @pool with one stream, so that writers can always make
+ * progress even when no more can be allocated.
+ */
+int zram_strm_pool_init(struct zram_strm_pool *pool,
+			const struct zram_compressor *comp, int max_strm)
+{
+	struct zram_strm *strm;
+
+	pool->comp = comp;
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->idle);
+	init_waitqueue_head(&pool->wait);
+	pool->max_strm = max(max_strm, 1);
+
+	strm = zram_strm_alloc(comp, GFP_KERNEL);
+	if (!strm)
+		return -ENOMEM;
+
+	list_add(&strm->list, &pool->idle);
+	pool->avail_strm = 1;
+	return 0;
+}
+
+void zram_strm_pool_destroy(struct zram_strm_pool *pool)
+{
+	struct zram_strm *strm;
+
+	/* never set up, or already destroyed */
+	if (!pool->max_strm)
+		return;
+
+	while (!list_empty(&pool->idle)) {
+		strm = list_first_entry(&pool->idle, struct zram_strm, list);
+		list_del(&strm->list);
+		zram_strm_free(strm);
+		pool->avail_strm--;
+	}
+
+	WARN_ON(pool->avail_strm);
+	pool->max_strm = 0;
+}
+
+struct zram_strm *zram_strm_get(struct zram_strm_pool *pool)
+{
+	struct zram_strm *strm;
+
+	for (;;) {
+		spin_lock(&pool->lock);
+		if (!list_empty(&pool->idle)) {
+			strm = list_first_entry(&pool->idle,
+						struct zram_strm, list);
+			list_del(&strm->list);
+			spin_unlock(&pool->lock);
+			return strm;
+		}
+
+		if (pool->avail_strm >= pool->max_strm) {
+			spin_unlock(&pool->lock);
+			wait_event(pool->wait, !list_empty(&pool->idle));
+			continue;
+		}
+
+		pool->avail_strm++;
+		spin_unlock(&pool->lock);
+
+		strm = zram_strm_alloc(pool->comp, GFP_NOIO);
+		if (strm)
+			return strm;
+
+		/* Out of memory: wait for one of the existing streams */
+		spin_lock(&pool->lock);
+		pool->avail_strm--;
+		spin_unlock(&pool->lock);
+		wait_event(pool->wait, !list_empty(&pool->idle));
+	}
+}
+
+void zram_strm_put(struct zram_strm_pool *pool, struct zram_strm *strm)
+{
+	spin_lock(&pool->lock);
+	list_add(&strm->list, &pool->idle);
+	spin_unlock(&pool->lock);
+
+	wake_up(&pool->wait);
+}
@@ -0,0 +1,72 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_COMP_H_
+#define _ZRAM_COMP_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+#define ZRAM_DEFAULT_COMPRESSOR	"lzo"
+
+/*
+ * A page compression backend. Both directions work on whole pages:
+ * compress() reads PAGE_SIZE bytes and may write up to 2 * PAGE_SIZE,
+ * decompress() must produce exactly PAGE_SIZE bytes. Both return 0 on
+ * success and a negative, backend specific, error code otherwise.
+ */
+struct zram_compressor {
+	const char *name;
+	size_t workmem_size;
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst);
+};
+
+/* Working memory and output buffer for one compression in flight */
+struct zram_strm {
+	void *workmem;
+	void *buffer;		/* 2 * PAGE_SIZE */
+	struct list_head list;
+};
+
+/*
+ * Streams are created on demand, up to max_strm of them, and handed out
+ * to writers; a writer finding none idle and the limit reached waits for
+ * one to be released.
+ */
+struct zram_strm_pool {
+	const struct zram_compressor *comp;
+	spinlock_t lock;
+	struct list_head idle;
+	wait_queue_head_t wait;
+	int avail_strm;		/* streams in existence */
+	int max_strm;
+};
+
+extern const struct zram_compressor *zram_find_compressor(const char *name);
+extern ssize_t zram_show_compressors(const struct zram_compressor *cur,
+			char *buf);
+
+extern int zram_strm_pool_init(struct zram_strm_pool *pool,
+			const struct zram_compressor *comp, int max_strm);
+extern void zram_strm_pool_destroy(struct zram_strm_pool *pool);
+extern struct zram_strm *zram_strm_get(struct zram_strm_pool *pool);
+extern void zram_strm_put(struct zram_strm_pool *pool,
+			struct zram_strm *strm);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/* Hash buckets per stored page, as a shift */
+#define ZRAM_DEDUP_BUCKET_SHIFT	3
+
+static struct zram_hash *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum & (zram->hash_size - 1)];
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i;
+
+	if (!zram->use_dedup)
+		return 0;
+
+	zram->hash_size = roundup_pow_of_two(max_t(size_t,
+				num_pages >> ZRAM_DEDUP_BUCKET_SHIFT, 64));
+	zram->hash = vzalloc(zram->hash_size * sizeof(*zram->hash));
+	if (!zram->hash)
+		return -ENOMEM;
+
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		INIT_HLIST_HEAD(&zram->hash[i].head);
+	}
+
+	return 0;
+}
+
+/* All entries must have been put */
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+}
+
+u32 zram_dedup_checksum(struct page *page)
+{
+	void *mem = kmap_atomic(page, KM_USER0);
+	u32 checksum = jhash2(mem, PAGE_SIZE / sizeof(u32), 0);
+
+	kunmap_atomic(mem, KM_USER0);
+	return checksum;
+}
+
+/* Called with the bucket locked */
+static int zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+			struct page *page, unsigned char *buf)
+{
+	unsigned char *user_mem, *cmem;
+	int match;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	match = !zram->comp->decompress(cmem, entry->len, buf);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+	if (!match)
+		return 0;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	match = !memcmp(user_mem, buf, PAGE_SIZE);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	return match;
+}
+
+/*
+ * Looks for an object holding the same data as @page, whose checksum
+ * is @checksum, and takes a reference to it. Candidates are
+ * decompressed into @buf, of at least PAGE_SIZE bytes, and compared
+ * byte by byte, so a checksum collision never merges different pages.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, struct page *page,
+				u32 checksum, unsigned char *buf)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, checksum);
+	struct zram_entry *entry;
+	struct hlist_node *pos;
+
+	spin_lock(&hash->lock);
+	hlist_for_each_entry(entry, pos, &hash->head, node) {
+		if (entry->checksum != checksum)
+			continue;
+		if (zram_dedup_match(zram, entry, page, buf)) {
+			entry->refcount++;
+			spin_unlock(&hash->lock);
+			return entry;
+		}
+	}
+	spin_unlock(&hash->lock);
+
+	return NULL;
+}
+
+/*
+ * Makes the object @handle, just written, available to later writes of
+ * the same data. Returns its entry, holding one reference, or NULL if
+ * out of memory.
+ */
+struct zram_entry *zram_dedup_insert(struct zram *zram, unsigned long handle,
+				unsigned int len, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, checksum);
+	struct zram_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	spin_lock(&hash->lock);
+	hlist_add_head(&entry->node, &hash->head);
+	spin_unlock(&hash->lock);
+
+	return entry;
+}
+
+/*
+ * Drops a slot's reference to @entry, freeing the object with the last
+ * one. Returns 1 if other slots still share it.
+ */
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, entry->checksum);
+	unsigned int refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount)
+		hlist_del(&entry->node);
+	spin_unlock(&hash->lock);
+
+	if (refcount)
+		return 1;
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+	return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct zram;
+struct page;
+
+/*
+ * A compressed object shared by all slots holding the same page. Slots
+ * flagged ZRAM_DEDUP point to one of these instead of to the object.
+ */
+struct zram_entry {
+	struct hlist_node node;	/* in its hash bucket */
+	unsigned long handle;	/* zsmalloc handle of the object */
+	unsigned int len;	/* compressed length */
+	u32 checksum;		/* of the uncompressed page */
+	unsigned int refcount;	/* slots using it, under the bucket lock */
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+u32 zram_dedup_checksum(struct page *page);
+struct zram_entry *zram_dedup_find(struct zram *zram, struct page *page,
+				u32 checksum, unsigned char *buf);
+struct zram_entry *zram_dedup_insert(struct zram *zram, unsigned long handle,
+				unsigned int len, u32 checksum);
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+
+#endif
@@ -24,10 +24,13 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -38,14 +41,14 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -70,19 +73,49 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	return zram->table[index].value & BIT(flag);
 }
 
 static void zram_set_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags |= BIT(flag);
+	zram->table[index].value |= BIT(flag);
 }
 
 static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	zram->table[index].value &= ~BIT(flag);
+}
+
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
+{
+	return zram->table[index].value >> ZRAM_FLAG_SHIFT;
+}
+
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
+{
+	unsigned long flags = zram->table[index].value &
+				(BIT(ZRAM_FLAG_SHIFT) - 1);
+
+	zram->table[index].value = (unsigned long)size << ZRAM_FLAG_SHIFT |
+				flags;
+}
+
+/*
+ * Serializes everything done to one disk page, so that writers of
+ * different pages never contend with each other. Flag and size updates
+ * under the lock may be non-atomic: other CPUs only ever try to set
+ * ZRAM_ACCESS, which is already set.
+ */
+static void zram_lock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
+}
+
+static void zram_unlock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
 static int page_zero_filled(void *ptr)
@@ -129,15 +162,144 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#define ZRAM_BD_MODE	(FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+/*
+ * Reserves up to @nr consecutive blocks on the backing device, fewer if
+ * that many are not free in a row. Returns how many, 0 if it is full.
+ */
+static unsigned int zram_bd_alloc(struct zram *zram, unsigned int nr,
+				unsigned long *block)
+{
+	unsigned long start = 0;
+
+	spin_lock(&zram->bd_lock);
+	for (; nr; nr /= 2) {
+		start = bitmap_find_next_zero_area(zram->bd_map,
+					zram->bd_blocks, 1, nr, 0);
+		if (start + nr <= zram->bd_blocks) {
+			bitmap_set(zram->bd_map, start, nr);
+			break;
+		}
+	}
+	spin_unlock(&zram->bd_lock);
+
+	*block = start;
+	return nr;
+}
+
+static void zram_bd_free(struct zram *zram, unsigned long block,
+			unsigned int nr)
+{
+	spin_lock(&zram->bd_lock);
+	bitmap_clear(zram->bd_map, block, nr);
+	spin_unlock(&zram->bd_lock);
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Transfers @nr pages from or to consecutive blocks of the backing
+ * device, starting at @block, and waits for the I/O. Returns the number
+ * of pages transferred, which is less than @nr if the device does not
+ * take that many in one bio.
+ */
+static int zram_bd_rw(struct zram *zram, int rw, struct page **pages,
+			unsigned int nr, unsigned long block)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	unsigned int i;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, nr);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->backing_bdev;
+	bio->bi_sector = (sector_t)block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = &done;
+
+	for (i = 0; i < nr; i++)
+		if (!bio_add_page(bio, pages[i], PAGE_SIZE, 0))
+			break;
+	if (!i) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? i : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bd_read {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long block;
+	int error;
+};
+
+static void zram_bd_read_fn(struct work_struct *work)
+{
+	struct zram_bd_read *rd = container_of(work, struct zram_bd_read,
+						work);
+	int ret;
+
+	ret = zram_bd_rw(rd->zram, READ_SYNC, &rd->page, 1, rd->block);
+	rd->error = ret < 0 ? ret : 0;
+}
+
+/*
+ * Reads a page back from the backing device. Bios submitted from within
+ * zram's make_request function would only be issued after it returns,
+ * so the read is done, and waited for, from a worker.
+ */
+static int zram_bd_read(struct zram *zram, struct page *page,
+			unsigned long block)
+{
+	struct zram_bd_read rd = {
+		.zram = zram,
+		.page = page,
+		.block = block,
+	};
+
+	INIT_WORK_ONSTACK(&rd.work, zram_bd_read_fn);
+	queue_work(system_unbound_wq, &rd.work);
+	flush_work(&rd.work);
+	destroy_work_on_stack(&rd.work);
+
+	if (unlikely(rd.error)) {
+		pr_err("Backing device read failed! err=%d, block=%lu\n",
+			rd.error, block);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return rd.error;
+	}
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	flush_dcache_page(page);
+	return 0;
+}
+
+/* Called with the slot locked */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -149,19 +311,30 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		clen = 0;
+		zram_bd_free(zram, handle, 1);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.bd_count);
+		goto out;
+	}
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram_get_obj_size(zram, index);
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		if (zram_dedup_put(zram, (struct zram_entry *)handle))
+			zram_stat64_sub(zram, &zram->stats.dedup_saved, clen);
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+	} else {
+		zs_free(zram->mem_pool, handle);
+	}
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -169,8 +342,8 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram_set_obj_size(zram, index, 0);
 }
 
 static void handle_zero_page(struct page *page)
@@ -190,8 +363,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic((struct page *)zram->table[index].handle, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -200,208 +372,264 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static int zram_read(struct zram *zram, struct bio *bio)
+/* Called with the slot locked; the page must be held in memory */
+static int zram_decompress_page(struct zram *zram, struct page *page,
+				u32 index)
 {
+	int ret;
+	unsigned long handle;
+	unsigned char *user_mem, *cmem;
 
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
-
-	if (unlikely(!zram->init_done)) {
-		set_bit(BIO_UPTODATE, &bio->bi_flags);
-		bio_endio(bio, 0);
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
 		return 0;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+	handle = zram->table[index].handle;
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		handle = ((struct zram_entry *)handle)->handle;
 
-		page = bvec->bv_page;
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
+	ret = zram->comp->decompress(cmem, zram_get_obj_size(zram, index),
+				user_mem);
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			/* Do nothing */
-			index++;
-			continue;
-		}
+	zs_unmap_object(zram->mem_pool, handle);
+	kunmap_atomic(user_mem, KM_USER0);
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
-		}
+	return ret;
+}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+static int zram_bvec_read(struct zram *zram, struct page *page, u32 index)
+{
+	int ret;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_unlock_slot(zram, index);
+		handle_zero_page(page);
+		return 0;
+	}
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].handle)) {
+		zram_unlock_slot(zram, index);
+		pr_debug("Read before write: page=%u\n", index);
+		/* Do nothing */
+		return 0;
+	}
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
-			zram_stat64_inc(zram, &zram->stats.failed_reads);
-			goto out;
-		}
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		unsigned long block = zram->table[index].handle;
 
-		flush_dcache_page(page);
-		index++;
+		zram_unlock_slot(zram, index);
+		return zram_bd_read(zram, page, block);
 	}
 
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
-	return 0;
+	ret = zram_decompress_page(zram, page, index);
+	zram_unlock_slot(zram, index);
 
-out:
-	bio_io_error(bio);
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return -EIO;
+	}
+
+	flush_dcache_page(page);
 	return 0;
 }
 
-static int zram_write(struct zram *zram, struct bio *bio)
+static int zram_read(struct zram *zram, struct bio *bio)
 {
-	int i, ret;
+
+	int i;
 	u32 index;
 	struct bio_vec *bvec;
 
 	if (unlikely(!zram->init_done)) {
-		ret = zram_init_device(zram);
-		if (ret)
-			goto out;
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+		bio_endio(bio, 0);
+		return 0;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_writes);
+	zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
+		if (zram_bvec_read(zram, bvec->bv_page, index))
+			goto out;
+		index++;
+	}
+
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, 0);
+	return 0;
+
+out:
+	bio_io_error(bio);
+	return 0;
+}
 
-		page = bvec->bv_page;
-		src = zram->compress_buffer;
+/*
+ * Compression and allocation of the new object happen without the slot
+ * lock; it is only taken to swap the new object in for the old one.
+ */
+static int zram_bvec_write(struct zram *zram, struct page *page, u32 index)
+{
+	int ret;
+	size_t clen;
+	int incompressible = 0, dedup = 0;
+	u32 checksum = 0;
+	unsigned long handle;
+	struct zram_entry *entry;
+	struct zram_strm *strm;
+	struct page *page_store;
+	unsigned char *user_mem, *cmem, *src;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (page_zero_filled(user_mem)) {
+		kunmap_atomic(user_mem, KM_USER0);
 
 		/*
 		 * System overwrites unused sectors. Free memory associated
 		 * with this sector now.
 		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
-
-		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
-			index++;
-			continue;
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_ZERO);
+		zram_unlock_slot(zram, index);
+		zram_stat_inc(&zram->stats.pages_zero);
+		return 0;
+	}
+	kunmap_atomic(user_mem, KM_USER0);
+
+	strm = zram_strm_get(&zram->strm_pool);
+
+	if (zram->use_dedup) {
+		checksum = zram_dedup_checksum(page);
+		entry = zram_dedup_find(zram, page, checksum, strm->buffer);
+		zram_stat64_inc(zram, &zram->stats.dedup_lookups);
+		if (entry) {
+			zram_strm_put(&zram->strm_pool, strm);
+			zram_stat64_inc(zram, &zram->stats.dedup_hits);
+			zram_stat64_add(zram, &zram->stats.dedup_saved,
+					entry->len);
+			handle = (unsigned long)entry;
+			clen = entry->len;
+			dedup = 1;
+			goto store;
 		}
+	}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = zram->comp->compress(user_mem, strm->buffer, &clen,
+				strm->workmem);
+	kunmap_atomic(user_mem, KM_USER0);
 
-		kunmap_atomic(user_mem, KM_USER0);
+	if (unlikely(ret)) {
+		zram_strm_put(&zram->strm_pool, strm);
+		pr_err("Compression failed! err=%d\n", ret);
+		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		return -EIO;
+	}
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
-			pr_err("Compression failed! err=%d\n", ret);
+	/*
+	 * Page is incompressible. Store it as-is (uncompressed)
+	 * since we do not want to return too many disk write
+	 * errors which has side effect of hanging the system.
+	 */
+	if (unlikely(clen > max_zpage_size)) {
+		zram_strm_put(&zram->strm_pool, strm);
+		incompressible = 1;
+		clen = PAGE_SIZE;
+		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!page_store)) {
+			pr_info("Error allocating memory for "
+				"incompressible page: %u\n", index);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			return -ENOMEM;
 		}
 
-		/*
-		 * Page is incompressible. Store it as-is (uncompressed)
-		 * since we do not want to return too many disk write
-		 * errors which has side effect of hanging the system.
-		 */
-		if (unlikely(clen > max_zpage_size)) {
-			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
-				goto out;
-			}
-
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
-
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		handle = (unsigned long)page_store;
+		src = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+	} else {
+		handle = zs_malloc(zram->mem_pool, clen);
+		if (!handle) {
+			zram_strm_put(&zram->strm_pool, strm);
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			return -ENOMEM;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, strm->buffer, clen);
+		zs_unmap_object(zram->mem_pool, handle);
+		zram_strm_put(&zram->strm_pool, strm);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+		if (zram->use_dedup) {
+			entry = zram_dedup_insert(zram, handle, clen, checksum);
+			if (!entry) {
+				zs_free(zram->mem_pool, handle);
+				zram_stat64_inc(zram,
+						&zram->stats.failed_writes);
+				return -ENOMEM;
+			}
+			handle = (unsigned long)entry;
+			dedup = 1;
 		}
-#endif
+	}
 
-		memcpy(cmem, src, clen);
+store:
+	zram_lock_slot(zram, index);
+	zram_free_page(zram, index);
+	zram->table[index].handle = handle;
+	zram_set_obj_size(zram, index, clen);
+	if (unlikely(incompressible))
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	if (dedup)
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	zram_unlock_slot(zram, index);
+
+	/* Update stats */
+	if (unlikely(incompressible))
+		zram_stat_inc(&zram->stats.pages_expand);
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	zram_stat_inc(&zram->stats.pages_stored);
+	if (clen <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+	return 0;
+}
+
+static int zram_write(struct zram *zram, struct bio *bio)
+{
+	int i, ret;
+	u32 index;
+	struct bio_vec *bvec;
+
+	if (unlikely(!zram->init_done)) {
+		ret = zram_init_device(zram);
+		if (ret)
+			goto out;
+	}
 
-		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
-		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+	zram_stat64_inc(zram, &zram->stats.num_writes);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-		mutex_unlock(&zram->lock);
+	bio_for_each_segment(bvec, bio, i) {
+		if (zram_bvec_write(zram, bvec->bv_page, index))
+			goto out;
 		index++;
 	}
 
@@ -439,6 +667,11 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	int ret = 0;
 	struct zram *zram = queue->queuedata;
 
+	if (unlikely(zram->bench_running)) {
+		bio_io_error(bio);
+		return 0;
+	}
+
 	if (!valid_io_request(zram, bio)) {
 		zram_stat64_inc(zram, &zram->stats.invalid_io);
 		bio_io_error(bio);
@@ -458,78 +691,70 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
-void zram_reset_device(struct zram *zram)
+/* Caller holds init_lock */
+static void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
-	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_strm_pool_destroy(&zram->strm_pool);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		unsigned long handle = zram->table[index].handle;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		if (!handle || zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page((struct page *)handle);
+		else if (zram_test_flag(zram, index, ZRAM_DEDUP))
+			zram_dedup_put(zram, (struct zram_entry *)handle);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zs_free(zram->mem_pool, handle);
 	}
 
+	zram_dedup_fini(zram);
+
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	/* The backing device stays attached, with all its blocks free */
+	if (zram->bd_map) {
+		bitmap_zero(zram->bd_map, zram->bd_blocks);
+		set_bit(0, zram->bd_map);
+	}
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
 	zram->disksize = 0;
+}
+
+void zram_reset_device(struct zram *zram)
+{
+	mutex_lock(&zram->init_lock);
+	__zram_reset_device(zram);
 	mutex_unlock(&zram->init_lock);
 }
 
-int zram_init_device(struct zram *zram)
+/* Caller holds init_lock */
+static int __zram_init_device(struct zram *zram)
 {
 	int ret;
 	size_t num_pages;
 
-	mutex_lock(&zram->init_lock);
-
-	if (zram->init_done) {
-		mutex_unlock(&zram->init_lock);
+	if (zram->init_done)
 		return 0;
-	}
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vzalloc(num_pages * sizeof(*zram->table));
 	if (!zram->table) {
@@ -540,12 +765,26 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret) {
+		pr_err("Error allocating dedup index\n");
+		goto fail;
+	}
+
+	/* One compression stream per CPU that may be writing */
+	ret = zram_strm_pool_init(&zram->strm_pool, zram->comp,
+				num_online_cpus());
+	if (ret) {
+		pr_err("Error allocating compression streams\n");
+		goto fail;
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -553,25 +792,514 @@ int zram_init_device(struct zram *zram)
 	}
 
 	zram->init_done = 1;
-	mutex_unlock(&zram->init_lock);
 
 	pr_debug("Initialization done!\n");
 	return 0;
 
 fail:
-	mutex_unlock(&zram->init_lock);
-	zram_reset_device(zram);
+	__zram_reset_device(zram);
 
 	pr_err("Initialization failed: err=%d\n", ret);
 	return ret;
 }
 
+int zram_init_device(struct zram *zram)
+{
+	int ret;
+
+	mutex_lock(&zram->init_lock);
+	/* The benchmark owns the device; don't let I/O initialize it */
+	if (zram->bench_running)
+		ret = -EBUSY;
+	else
+		ret = __zram_init_device(zram);
+	mutex_unlock(&zram->init_lock);
+
+	return ret;
+}
+
+/* Pages written and read back by one benchmark run, split across threads */
+#define ZRAM_BENCH_PAGES	(1 << 16)
+
+struct zram_bench_thread {
+	struct zram *zram;
+	struct page *page;
+	u32 first;
+	u32 nr;
+	int write;
+	int error;
+	struct completion done;
+};
+
+static int zram_bench_fn(void *data)
+{
+	struct zram_bench_thread *t = data;
+	u32 index;
+	int ret = 0;
+
+	for (index = t->first; index < t->first + t->nr && !ret; index++) {
+		if (t->write)
+			ret = zram_bvec_write(t->zram, t->page, index);
+		else
+			ret = zram_bvec_read(t->zram, t->page, index);
+		cond_resched();
+	}
+
+	t->error = ret;
+	complete(&t->done);
+	return 0;
+}
+
+/*
+ * Runs one phase on @threads threads, each bound to its own CPU as far
+ * as there are enough, and returns the throughput in KB/s.
+ */
+static int zram_bench_run(struct zram_bench_thread *t, unsigned int threads,
+			int write, u64 *kbps)
+{
+	struct task_struct **tasks;
+	unsigned int i, cpu = cpumask_first(cpu_online_mask);
+	ktime_t start;
+	u64 bytes = 0;
+	s64 us;
+	int ret = 0;
+
+	tasks = kcalloc(threads, sizeof(*tasks), GFP_KERNEL);
+	if (!tasks)
+		return -ENOMEM;
+
+	/* Create them all first so that they start together */
+	for (i = 0; i < threads; i++) {
+		t[i].write = write;
+		t[i].error = 0;
+		init_completion(&t[i].done);
+
+		tasks[i] = kthread_create(zram_bench_fn, &t[i],
+					"zram_bench/%u", i);
+		if (IS_ERR(tasks[i])) {
+			ret = PTR_ERR(tasks[i]);
+			while (i--)
+				kthread_stop(tasks[i]);
+			goto out;
+		}
+
+		kthread_bind(tasks[i], cpu);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	start = ktime_get();
+	for (i = 0; i < threads; i++)
+		wake_up_process(tasks[i]);
+
+	for (i = 0; i < threads; i++) {
+		wait_for_completion(&t[i].done);
+		if (t[i].error)
+			ret = t[i].error;
+		bytes += (u64)t[i].nr << PAGE_SHIFT;
+	}
+	us = ktime_us_delta(ktime_get(), start);
+
+	*kbps = div64_u64(bytes * USEC_PER_SEC, max_t(s64, us, 1) * 1024);
+
+out:
+	kfree(tasks);
+	return ret;
+}
+
+/*
+ * Fills a page with data that compresses to about half its size: random
+ * bytes in the first quarter, a repeating pattern in the rest.
+ */
+static void zram_bench_fill(struct page *page)
+{
+	unsigned char *mem = kmap(page);
+	unsigned int i;
+
+	get_random_bytes(mem, PAGE_SIZE / 4);
+	for (i = PAGE_SIZE / 4; i < PAGE_SIZE; i++)
+		mem[i] = "zram benchmark "[i % 15] ^ mem[i % 64];
+	kunmap(page);
+}
+
+/*
+ * Writes ZRAM_BENCH_PAGES pages to an unused device from @threads
+ * threads (0 meaning one per online CPU) and reads them back, with every
+ * thread working on its own range of slots.  The device is reset
+ * afterwards; the result is kept in zram->bench.
+ *
+ * init_lock is held throughout so that nothing can reset or initialize
+ * the device under the benchmark, and bios are failed until it is done.
+ */
+int zram_benchmark(struct zram *zram, unsigned int threads)
+{
+	struct zram_bench_thread *t;
+	struct block_device *bdev;
+	u64 disksize;
+	u64 write_kbps = 0, read_kbps = 0;
+	unsigned int i, pages;
+	int ret;
+
+	if (!threads)
+		threads = num_online_cpus();
+
+	bdev = bdget_disk(zram->disk, 0);
+	if (!bdev)
+		return -ENOMEM;
+
+	mutex_lock(&zram->init_lock);
+
+	/* Only an unused, uninitialized device may be benchmarked */
+	if (zram->init_done || bdev->bd_holders) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	zram->bench_running = 1;
+	disksize = zram->disksize;
+
+	ret = __zram_init_device(zram);
+	if (ret)
+		goto done;
+
+	pages = min_t(u64, zram->disksize >> PAGE_SHIFT,
+			ZRAM_BENCH_PAGES) / threads;
+	if (!pages) {
+		ret = -EINVAL;
+		goto reset;
+	}
+
+	t = kcalloc(threads, sizeof(*t), GFP_KERNEL);
+	if (!t) {
+		ret = -ENOMEM;
+		goto reset;
+	}
+
+	for (i = 0; i < threads; i++) {
+		t[i].zram = zram;
+		t[i].first = i * pages;
+		t[i].nr = pages;
+		t[i].page = alloc_page(GFP_KERNEL);
+		if (!t[i].page) {
+			ret = -ENOMEM;
+			goto free;
+		}
+		zram_bench_fill(t[i].page);
+	}
+
+	ret = zram_bench_run(t, threads, 1, &write_kbps);
+	if (!ret)
+		ret = zram_bench_run(t, threads, 0, &read_kbps);
+
+	if (!ret) {
+		zram->bench.threads = threads;
+		zram->bench.pages = pages;
+		zram->bench.write_kbps = write_kbps;
+		zram->bench.read_kbps = read_kbps;
+		pr_info("benchmark: %u threads, %u pages each: "
+			"write %llu KB/s, read %llu KB/s\n",
+			threads, pages, write_kbps, read_kbps);
+	}
+
+free:
+	for (i = 0; i < threads; i++)
+		if (t[i].page)
+			__free_page(t[i].page);
+	kfree(t);
+reset:
+	__zram_reset_device(zram);
+done:
+	zram->disksize = disksize;
+	set_capacity(zram->disk, disksize >> SECTOR_SHIFT);
+	zram->bench_running = 0;
+unlock:
+	mutex_unlock(&zram->init_lock);
+	bdput(bdev);
+	return ret;
+}
+
+/*
+ * Releases sparsely used allocator pages; returns the number freed.
+ */
+int zram_compact(struct zram *zram)
+{
+	unsigned long freed = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		freed = zs_compact(zram->mem_pool);
+		zram_stat64_add(zram, &zram->stats.pages_compacted, freed);
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return freed;
+}
+
+/*
+ * Attaches the block device at @path as backing device, replacing any
+ * previous one; an empty path or "none" just detaches it.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev = NULL;
+	unsigned long *map = NULL;
+	unsigned long blocks = 0;
+	char *name = NULL;
+	int ret = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing device for initialized "
+			"device\n");
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (*path && strcmp(path, "none")) {
+		name = kstrdup(path, GFP_KERNEL);
+		if (!name) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		bdev = blkdev_get_by_path(name, ZRAM_BD_MODE, zram);
+		if (IS_ERR(bdev)) {
+			ret = PTR_ERR(bdev);
+			bdev = NULL;
+			goto out;
+		}
+
+		blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+		if (blocks < 2) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		ret = set_blocksize(bdev, PAGE_SIZE);
+		if (ret)
+			goto out;
+
+		map = vzalloc(BITS_TO_LONGS(blocks) * sizeof(long));
+		if (!map) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		set_bit(0, map);
+	}
+
+	swap(zram->backing_bdev, bdev);
+	swap(zram->backing_path, name);
+	swap(zram->bd_map, map);
+	zram->bd_blocks = blocks;
+
+	if (zram->backing_bdev)
+		pr_info("%s: using %s as backing device, %lu blocks\n",
+			zram->disk->disk_name, zram->backing_path, blocks - 1);
+
+out:
+	mutex_unlock(&zram->init_lock);
+
+	/* the old device, on success */
+	if (bdev)
+		blkdev_put(bdev, ZRAM_BD_MODE);
+	kfree(name);
+	vfree(map);
+
+	return ret;
+}
+
+/*
+ * Marks every page held in memory idle. Accessing a page clears the mark,
+ * so pages still marked at the next writeback have not been used since.
+ */
+int zram_mark_idle(struct zram *zram)
+{
+	u32 index;
+	int ret = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_slot(zram, index);
+		if (zram->table[index].handle &&
+				!zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_slot(zram, index);
+
+		if (!(index % 1024))
+			cond_resched();
+	}
+
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
+}
+
+/*
+ * Copies the page in slot @index to @page and marks the slot
+ * ZRAM_UNDER_WB if it is to be written out under @mode.
+ */
+static int zram_wb_take(struct zram *zram, u32 index,
+			enum zram_wb_mode mode, struct page *page)
+{
+	int taken = 0;
+
+	zram_lock_slot(zram, index);
+
+	if (!zram->table[index].handle ||
+			zram_test_flag(zram, index, ZRAM_WB))
+		goto out;
+
+	if (mode == ZRAM_WB_IDLE &&
+			!zram_test_flag(zram, index, ZRAM_IDLE))
+		goto out;
+
+	if (mode == ZRAM_WB_INCOMPRESSIBLE &&
+			!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		goto out;
+
+	if (zram_decompress_page(zram, page, index))
+		goto out;
+
+	zram_set_flag(zram, index, ZRAM_UNDER_WB);
+	taken = 1;
+
+out:
+	zram_unlock_slot(zram, index);
+	return taken;
+}
+
+/*
+ * Frees the memory of a slot whose page is now on the backing device at
+ * @block, unless it was rewritten or freed while being written out.
+ */
+static void zram_wb_commit(struct zram *zram, u32 index, unsigned long block)
+{
+	zram_lock_slot(zram, index);
+	if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		zram_unlock_slot(zram, index);
+		zram_bd_free(zram, block, 1);
+		return;
+	}
+
+	zram_free_page(zram, index);
+	zram->table[index].handle = block;
+	zram_set_flag(zram, index, ZRAM_WB);
+	zram_unlock_slot(zram, index);
+
+	zram_stat_inc(&zram->stats.bd_count);
+	zram_stat_inc(&zram->stats.pages_stored);
+}
+
+/*
+ * Writes out the @nr pages taken by zram_wb_take(), as few bios as the
+ * free space on the backing device allows.
+ */
+static int zram_wb_flush(struct zram *zram, struct page **pages,
+			u32 *index, unsigned int nr)
+{
+	unsigned long block;
+	unsigned int i, n, done = 0;
+	int ret = 0;
+
+	while (done < nr) {
+		n = zram_bd_alloc(zram, nr - done, &block);
+		if (!n) {
+			ret = -ENOSPC;
+			break;
+		}
+
+		ret = zram_bd_rw(zram, WRITE_SYNC, pages + done, n, block);
+		if (ret < 0) {
+			zram_bd_free(zram, block, n);
+			break;
+		}
+		if (ret < n)
+			zram_bd_free(zram, block + ret, n - ret);
+
+		for (i = 0; i < ret; i++)
+			zram_wb_commit(zram, index[done + i], block + i);
+		zram_stat64_add(zram, &zram->stats.bd_writes, ret);
+
+		done += ret;
+		ret = 0;
+	}
+
+	/* Whatever could not be written out stays in memory */
+	for (i = done; i < nr; i++) {
+		zram_lock_slot(zram, index[i]);
+		zram_clear_flag(zram, index[i], ZRAM_UNDER_WB);
+		zram_unlock_slot(zram, index[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * Moves idle or incompressible pages, depending on @mode, to the backing
+ * device, ZRAM_WB_BATCH pages per bio.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	struct page *pages[ZRAM_WB_BATCH] = { NULL };
+	u32 index[ZRAM_WB_BATCH];
+	unsigned int i, nr = 0;
+	u32 slot;
+	int ret = 0;
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i]) {
+			ret = -ENOMEM;
+			goto free;
+		}
+	}
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->backing_bdev) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	for (slot = 0; slot < zram->disksize >> PAGE_SHIFT; slot++) {
+		if (zram_wb_take(zram, slot, mode, pages[nr]))
+			index[nr++] = slot;
+
+		if (nr == ZRAM_WB_BATCH) {
+			ret = zram_wb_flush(zram, pages, index, nr);
+			nr = 0;
+			if (ret)
+				break;
+		}
+		cond_resched();
+	}
+
+	if (nr)
+		ret = zram_wb_flush(zram, pages, index, nr);
+
+unlock:
+	mutex_unlock(&zram->init_lock);
+free:
+	for (i = 0; i < ZRAM_WB_BATCH; i++)
+		if (pages[i])
+			__free_page(pages[i]);
+
+	return ret;
+}
+
 void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 {
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
+	zram_unlock_slot(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -584,9 +1312,10 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->bd_lock);
+	zram->comp = zram_find_compressor(ZRAM_DEFAULT_COMPRESSOR);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -721,6 +1450,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_set_backing_dev(zram, "none");
 	}
 
 	unregister_blkdev(zram_major, "zram");
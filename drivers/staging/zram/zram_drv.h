@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/bit_spinlock.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zram_comp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +29,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -51,8 +42,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -62,6 +53,15 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
 #define SECTORS_PER_PAGE	(1 << SECTORS_PER_PAGE_SHIFT)
 
+/* Pages written to the backing device by one bio */
+#define ZRAM_WB_BATCH		32
+
+/* What zram_writeback() writes out */
+enum zram_wb_mode {
+	ZRAM_WB_IDLE,		/* pages marked ZRAM_IDLE */
+	ZRAM_WB_INCOMPRESSIBLE,	/* pages stored uncompressed */
+};
+
 /* Flags for zram pages (table[page_no].flags) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
@@ -70,18 +70,41 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Slot lock, see zram_lock_slot() */
+	ZRAM_ACCESS,
+
+	/* Page is stored on the backing device */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page has not been accessed since slots were last marked idle */
+	ZRAM_IDLE,
+
+	/* Handle is a struct zram_entry *, possibly shared with other slots */
+	ZRAM_DEDUP,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/* table[page_no].value: object size above this, flags below */
+#define ZRAM_FLAG_SHIFT		8
+
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * Allocated for each disk page. Both fields may only be changed, and the
+ * object they point to only be read, with the slot locked.
+ */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __attribute__((aligned(4)));
+	/*
+	 * zsmalloc handle, struct zram_entry * if ZRAM_DEDUP, struct page *
+	 * if ZRAM_UNCOMPRESSED, or block on the backing device if ZRAM_WB
+	 */
+	unsigned long handle;
+	unsigned long value;	/* size << ZRAM_FLAG_SHIFT | flags */
+};
 
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
@@ -91,32 +114,68 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 pages_compacted;	/* pages released by compaction */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u64 dedup_lookups;	/* writes looked up in the dedup index */
+	u64 dedup_hits;		/* writes that found an identical page */
+	u64 dedup_saved;	/* bytes of objects shared between slots */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+	atomic_t bd_count;	/* no. of pages on the backing device */
+};
+
+/* Result of the last run of the sysfs benchmark */
+struct zram_bench {
+	unsigned int threads;
+	unsigned int pages;		/* per thread */
+	u64 write_kbps;
+	u64 read_kbps;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	const struct zram_compressor *comp;
+	struct zram_strm_pool strm_pool;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
 	/* Prevent concurrent execution of device init and reset */
 	struct mutex init_lock;
+	/* Set under init_lock while zram_benchmark() owns the device */
+	int bench_running;
 	/*
 	 * This is the limit on amount of *uncompressed* worth of data
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
 
+	/*
+	 * Optional block device that idle and incompressible pages are
+	 * written out to, one page per block. Set while the device is not
+	 * initialized; bd_map has a bit set for each block in use, block 0
+	 * being reserved so that no slot's handle is 0.
+	 */
+	struct block_device *backing_bdev;
+	char *backing_path;
+	unsigned long *bd_map;
+	unsigned long bd_blocks;
+	spinlock_t bd_lock;	/* protects bd_map */
+
+	/*
+	 * Index of compressed objects by checksum, if use_dedup was set
+	 * before the device was initialized.
+	 */
+	int use_dedup;
+	struct zram_hash *hash;
+	size_t hash_size;
+
 	struct zram_stats stats;
+	struct zram_bench bench;
 };
 
 extern struct zram *devices;
@@ -127,5 +186,10 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_benchmark(struct zram *zram, unsigned int threads);
+extern int zram_compact(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern int zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
 
 #endif
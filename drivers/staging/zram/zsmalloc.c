@@ -0,0 +1,663 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are served from size classes ZS_SIZE_CLASS_DELTA bytes apart.
+ * A class carves its objects out of zspages: up to ZS_MAX_PAGES_PER_ZSPAGE
+ * 0-order pages treated as one contiguous range, so objects may straddle
+ * a page boundary and every class can use the zspage size that wastes
+ * the least. Pages may come from highmem; objects are only accessible
+ * between zs_map_object() and zs_unmap_object().
+ *
+ * Each object starts with a header word. In an allocated object it holds
+ * the address of the object's handle with OBJ_ALLOCATED_TAG set, in a
+ * free one the index of the next free object in the zspage. The handle
+ * is what callers hold; it records where the object currently is, which
+ * lets zs_compact() move objects out of sparsely used zspages.
+ *
+ * Each class has its own lock. A handle's HANDLE_PIN_BIT pins the object
+ * in place while it is mapped or being freed; zs_compact() skips pinned
+ * objects instead of waiting for them.
+ *
+ * kmap_atomic() slots: KM_USER1 for zs_map_object(), KM_USER0 for
+ * allocation and freeing. Compaction uses both.
+ */
+
+#include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((PAGE_SIZE - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* object header */
+#define OBJ_ALLOCATED_TAG	1UL
+#define OBJ_TAG_BITS		1
+#define OBJ_NONE		(~0UL >> OBJ_TAG_BITS)	/* end of free list */
+
+/* zs_handle->idx: object index above HANDLE_IDX_SHIFT, pin bit below */
+#define HANDLE_PIN_BIT		0
+#define HANDLE_IDX_SHIFT	1
+
+enum fullness_group {
+	ZS_EMPTY,
+	ZS_ALMOST_EMPTY,	/* at most 3/4 of the objects in use */
+	ZS_ALMOST_FULL,
+	ZS_FULL,
+	NR_ZS_FULLNESS,
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[NR_ZS_FULLNESS];
+	int size;		/* of each object, header included */
+	int pages_per_zspage;
+	int objs_per_zspage;
+};
+
+struct zspage {
+	struct list_head list;	/* in class->fullness_list[fullness] */
+	struct size_class *class;
+	enum fullness_group fullness;
+	unsigned int inuse;
+	unsigned long freeobj;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct zs_handle {
+	unsigned long idx;
+	struct zspage *zspage;
+};
+
+/* Per-CPU state of the object currently mapped */
+struct zs_map_area {
+	char *buf;		/* bounce buffer for straddling objects */
+	void *kaddr;		/* or the page mapping, if not straddling */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	const char *name;
+	gfp_t flags;
+	atomic_long_t pages_allocated;
+	struct zs_map_area __percpu *map_area;
+	struct size_class classes[ZS_SIZE_CLASSES];
+};
+
+static int get_size_class_index(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Picks the zspage size, in pages, that leaves the smallest fraction of
+ * it unused by objects of @class_size bytes.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, best = 1, best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size = i * PAGE_SIZE;
+		int waste = zspage_size % class_size;
+		int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+				struct zspage *zspage)
+{
+	if (!zspage->inuse)
+		return ZS_EMPTY;
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse <= class->objs_per_zspage * 3 / 4)
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+/* Called with the class locked */
+static void fix_fullness_group(struct size_class *class, struct zspage *zspage)
+{
+	enum fullness_group fg = get_fullness_group(class, zspage);
+
+	if (fg == zspage->fullness)
+		return;
+
+	zspage->fullness = fg;
+	list_move(&zspage->list, &class->fullness_list[fg]);
+}
+
+/* Byte offset of object @idx within its zspage */
+static unsigned long obj_offset(struct size_class *class, unsigned long idx)
+{
+	return idx * class->size;
+}
+
+/*
+ * The header is at a ZS_SIZE_CLASS_DELTA aligned offset, so it never
+ * straddles two pages.
+ */
+static unsigned long *obj_map_header(struct zspage *zspage, unsigned long off)
+{
+	void *addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER0);
+
+	return addr + (off & ~PAGE_MASK);
+}
+
+static unsigned long obj_read_header(struct size_class *class,
+				struct zspage *zspage, unsigned long idx)
+{
+	unsigned long *hdr = obj_map_header(zspage, obj_offset(class, idx));
+	unsigned long val = *hdr;
+
+	kunmap_atomic(hdr, KM_USER0);
+	return val;
+}
+
+static void obj_write_header(struct size_class *class, struct zspage *zspage,
+				unsigned long idx, unsigned long val)
+{
+	unsigned long *hdr = obj_map_header(zspage, obj_offset(class, idx));
+
+	*hdr = val;
+	kunmap_atomic(hdr, KM_USER0);
+}
+
+/* Called with the class locked and a free object in @zspage */
+static unsigned long obj_alloc(struct size_class *class,
+				struct zspage *zspage, struct zs_handle *handle)
+{
+	unsigned long idx = zspage->freeobj;
+
+	zspage->freeobj = obj_read_header(class, zspage, idx) >> OBJ_TAG_BITS;
+	obj_write_header(class, zspage, idx,
+			(unsigned long)handle | OBJ_ALLOCATED_TAG);
+	zspage->inuse++;
+
+	return idx;
+}
+
+/* Called with the class locked */
+static void obj_free(struct size_class *class, struct zspage *zspage,
+				unsigned long idx)
+{
+	obj_write_header(class, zspage, idx, zspage->freeobj << OBJ_TAG_BITS);
+	zspage->freeobj = idx;
+	zspage->inuse--;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	struct size_class *class = zspage->class;
+	int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+}
+
+/*
+ * Allocates a zspage with all objects on its free list. It is not on any
+ * of the class lists yet.
+ */
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct zspage *zspage;
+	unsigned long idx, next;
+	int i;
+
+	zspage = kzalloc(sizeof(*zspage), pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (!zspage->pages[i]) {
+			while (i--)
+				__free_page(zspage->pages[i]);
+			kfree(zspage);
+			return NULL;
+		}
+	}
+
+	zspage->class = class;
+	zspage->fullness = ZS_EMPTY;
+	INIT_LIST_HEAD(&zspage->list);
+
+	for (idx = 0; idx < class->objs_per_zspage; idx++) {
+		next = idx + 1 < class->objs_per_zspage ? idx + 1 : OBJ_NONE;
+		obj_write_header(class, zspage, idx, next << OBJ_TAG_BITS);
+	}
+	zspage->freeobj = 0;
+
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+	return zspage;
+}
+
+/* Prefers the fullest zspages, so that sparse ones can drain */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	struct list_head *head;
+
+	head = &class->fullness_list[ZS_ALMOST_FULL];
+	if (list_empty(head))
+		head = &class->fullness_list[ZS_ALMOST_EMPTY];
+	if (list_empty(head))
+		return NULL;
+
+	return list_first_entry(head, struct zspage, list);
+}
+
+/**
+ * zs_malloc - allocate an object from the pool
+ * @pool: pool to allocate from
+ * @size: object size, at most ZS_MAX_ALLOC_SIZE
+ *
+ * Returns a handle to the object, or 0 on failure. The handle is opaque:
+ * use zs_map_object() to get at the object.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned long idx;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kzalloc(sizeof(*handle), pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class = &pool->classes[get_size_class_index(size + ZS_HANDLE_SIZE)];
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class);
+		if (!zspage) {
+			kfree(handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->fullness_list[ZS_EMPTY]);
+	}
+
+	idx = obj_alloc(class, zspage, handle);
+	handle->zspage = zspage;
+	handle->idx = idx << HANDLE_IDX_SHIFT;
+	fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!obj))
+		return;
+
+	/*
+	 * Once pinned the object cannot move, so its zspage cannot go away
+	 * before we hold the class lock.
+	 */
+	bit_spin_lock(HANDLE_PIN_BIT, &handle->idx);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	obj_free(class, zspage, handle->idx >> HANDLE_IDX_SHIFT);
+	fix_fullness_group(class, zspage);
+	if (zspage->fullness == ZS_EMPTY) {
+		list_del(&zspage->list);
+		free_zspage(pool, zspage);
+	}
+	spin_unlock(&class->lock);
+
+	bit_spin_unlock(HANDLE_PIN_BIT, &handle->idx);
+	kfree(handle);
+}
+
+/*
+ * Copies the payload of a straddling object between @buf and its two
+ * pages.
+ */
+static void zs_copy_straddling(struct zspage *zspage, unsigned long off,
+				char *buf, int size, int to_buf)
+{
+	struct page *page = zspage->pages[off >> PAGE_SHIFT];
+	int first = PAGE_SIZE - (off & ~PAGE_MASK);
+	char *addr;
+
+	addr = kmap_atomic(page, KM_USER1) + (off & ~PAGE_MASK);
+	if (to_buf)
+		memcpy(buf, addr, first);
+	else
+		memcpy(addr, buf, first);
+	kunmap_atomic(addr, KM_USER1);
+
+	addr = kmap_atomic(zspage->pages[(off >> PAGE_SHIFT) + 1], KM_USER1);
+	if (to_buf)
+		memcpy(buf + first, addr, size - first);
+	else
+		memcpy(addr, buf + first, size - first);
+	kunmap_atomic(addr, KM_USER1);
+}
+
+/**
+ * zs_map_object - get access to an object
+ * @pool: pool the object belongs to
+ * @handle: handle returned by zs_malloc()
+ * @mm: what the caller is going to do with the object
+ *
+ * Returns the address of the object's payload, valid until
+ * zs_unmap_object(). The mapping is atomic: the caller must not sleep
+ * while it holds it, and may hold only one per pool.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_map_area *area;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned long off;
+	int size;
+
+	/* also disables preemption, so the area is ours */
+	bit_spin_lock(HANDLE_PIN_BIT, &handle->idx);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	off = obj_offset(class, handle->idx >> HANDLE_IDX_SHIFT) +
+		ZS_HANDLE_SIZE;
+	size = class->size - ZS_HANDLE_SIZE;
+
+	area = this_cpu_ptr(pool->map_area);
+	area->mm = mm;
+
+	if ((off & ~PAGE_MASK) + size <= PAGE_SIZE) {
+		area->kaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT],
+					KM_USER1);
+		return area->kaddr + (off & ~PAGE_MASK);
+	}
+
+	area->kaddr = NULL;
+	if (mm != ZS_MM_WO)
+		zs_copy_straddling(zspage, off, area->buf, size, 1);
+
+	return area->buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_map_area *area = this_cpu_ptr(pool->map_area);
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned long off;
+
+	if (area->kaddr) {
+		kunmap_atomic(area->kaddr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		zspage = handle->zspage;
+		class = zspage->class;
+		off = obj_offset(class, handle->idx >> HANDLE_IDX_SHIFT) +
+			ZS_HANDLE_SIZE;
+		zs_copy_straddling(zspage, off, area->buf,
+				class->size - ZS_HANDLE_SIZE, 0);
+	}
+
+	bit_spin_unlock(HANDLE_PIN_BIT, &handle->idx);
+}
+
+/* Copies the payload of one object to another slot of the same class */
+static void zs_copy_object(struct size_class *class,
+			struct zspage *dst, unsigned long didx,
+			struct zspage *src, unsigned long sidx)
+{
+	unsigned long d_off = obj_offset(class, didx) + ZS_HANDLE_SIZE;
+	unsigned long s_off = obj_offset(class, sidx) + ZS_HANDLE_SIZE;
+	int len = class->size - ZS_HANDLE_SIZE;
+	char *d_addr, *s_addr;
+	int n;
+
+	while (len) {
+		n = min_t(int, len, PAGE_SIZE - (d_off & ~PAGE_MASK));
+		n = min_t(int, n, PAGE_SIZE - (s_off & ~PAGE_MASK));
+
+		s_addr = kmap_atomic(src->pages[s_off >> PAGE_SHIFT], KM_USER0);
+		d_addr = kmap_atomic(dst->pages[d_off >> PAGE_SHIFT], KM_USER1);
+		memcpy(d_addr + (d_off & ~PAGE_MASK),
+			s_addr + (s_off & ~PAGE_MASK), n);
+		kunmap_atomic(d_addr, KM_USER1);
+		kunmap_atomic(s_addr, KM_USER0);
+
+		d_off += n;
+		s_off += n;
+		len -= n;
+	}
+}
+
+/*
+ * Moves objects from @src to @dst until @src is empty or @dst is full.
+ * Called with the class locked; fails with -EBUSY on a pinned object.
+ */
+static int migrate_zspage(struct size_class *class, struct zspage *dst,
+				struct zspage *src)
+{
+	struct zs_handle *handle;
+	unsigned long idx, didx, hdr;
+
+	for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+		if (dst->inuse == class->objs_per_zspage)
+			break;
+
+		hdr = obj_read_header(class, src, idx);
+		if (!(hdr & OBJ_ALLOCATED_TAG))
+			continue;
+
+		handle = (struct zs_handle *)(hdr & ~OBJ_ALLOCATED_TAG);
+		if (!bit_spin_trylock(HANDLE_PIN_BIT, &handle->idx))
+			return -EBUSY;
+
+		didx = obj_alloc(class, dst, handle);
+		zs_copy_object(class, dst, didx, src, idx);
+		handle->zspage = dst;
+		handle->idx = didx << HANDLE_IDX_SHIFT | BIT(HANDLE_PIN_BIT);
+		obj_free(class, src, idx);
+
+		bit_spin_unlock(HANDLE_PIN_BIT, &handle->idx);
+	}
+
+	return 0;
+}
+
+static unsigned long compact_class(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct list_head *sparse = &class->fullness_list[ZS_ALMOST_EMPTY];
+	struct zspage *src, *dst;
+	unsigned long freed = 0;
+	int ret;
+
+	spin_lock(&class->lock);
+	while (!list_empty(sparse)) {
+		/* drain from the tail, fill from the head */
+		src = list_entry(sparse->prev, struct zspage, list);
+		dst = find_get_zspage(class);
+		if (dst == src)
+			break;
+
+		ret = migrate_zspage(class, dst, src);
+		fix_fullness_group(class, dst);
+		fix_fullness_group(class, src);
+		if (src->fullness == ZS_EMPTY) {
+			list_del(&src->list);
+			free_zspage(pool, src);
+			freed += class->pages_per_zspage;
+		}
+		if (ret)
+			break;
+
+		spin_unlock(&class->lock);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - release sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Moves objects out of the least used zspages of every class into the
+ * fuller ones and frees the zspages left empty. Returns the number of
+ * pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		freed += compact_class(pool, &pool->classes[i]);
+		cond_resched();
+	}
+
+	return freed;
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+
+static void zs_free_map_areas(struct zs_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+	free_percpu(pool->map_area);
+}
+
+/**
+ * zs_create_pool - create an allocation pool
+ * @name: name of the pool
+ * @flags: allocation flags for the pool's pages, e.g. GFP_NOIO | __GFP_HIGHMEM
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	struct zs_pool *pool;
+	struct size_class *class;
+	int i, cpu;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->name = name;
+	pool->flags = flags;
+	atomic_long_set(&pool->pages_allocated, 0);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int fg;
+
+		class = &pool->classes[i];
+		spin_lock_init(&class->lock);
+		for (fg = 0; fg < NR_ZS_FULLNESS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+					class->size;
+	}
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!area->buf) {
+			zs_free_map_areas(pool);
+			goto fail;
+		}
+	}
+
+	return pool;
+
+fail:
+	kfree(pool);
+	return NULL;
+}
+
+/*
+ * All objects should have been freed; any zspages left behind are
+ * released regardless.
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	struct zspage *zspage, *tmp;
+	int i, fg;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		for (fg = 0; fg < NR_ZS_FULLNESS; fg++) {
+			list_for_each_entry_safe(zspage, tmp,
+				&pool->classes[i].fullness_list[fg], list) {
+				pr_info("%s: freeing zspage still in use "
+					"(class %d)\n", pool->name, i);
+				list_del(&zspage->list);
+				free_zspage(pool, zspage);
+			}
+		}
+	}
+
+	zs_free_map_areas(pool);
+	kfree(pool);
+}
@@ -77,6 +77,24 @@ static struct buffer_head *get_block_length(struct super_block *sb,
 }
 
 
+/*
+ * Start reading the device blocks backing the @bytes following @index,
+ * without waiting for them.  Called after a block has been submitted, so
+ * that the block most likely to be wanted next (files and metadata are
+ * mostly read sequentially) is already in the buffer cache by the time
+ * it is asked for, rather than costing another round trip to the device.
+ */
+static void squashfs_readahead(struct super_block *sb, u64 index, int bytes)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	u64 end = min_t(u64, index + bytes, msblk->bytes_used);
+	u64 block = index >> msblk->devblksize_log2;
+
+	end = (end + msblk->devblksize - 1) >> msblk->devblksize_log2;
+	for (; block < end; block++)
+		sb_breadahead(sb, block);
+}
+
 /*
  * Read and decompress a metadata block or datablock.  Length is non-zero
  * if a datablock is being read (the size is stored elsewhere in the
@@ -123,6 +141,7 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 			bytes += msblk->devblksize;
 		}
 		ll_rw_block(READ, b, bh);
+		squashfs_readahead(sb, index + length, msblk->block_size);
 	} else {
 		/*
 		 * Metadata block.
@@ -155,6 +174,8 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 			bytes += msblk->devblksize;
 		}
 		ll_rw_block(READ, b - 1, bh + 1);
+		squashfs_readahead(sb, index + length + 2,
+				SQUASHFS_METADATA_SIZE + 2);
 	}
 
 	if (compressed) {
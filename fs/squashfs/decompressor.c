@@ -23,6 +23,8 @@
 
 #include <linux/types.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
 #include <linux/buffer_head.h>
 
 #include "squashfs_fs.h"
@@ -51,6 +53,12 @@ static const struct squashfs_decompressor squashfs_xz_comp_ops = {
 };
 #endif
 
+#ifndef CONFIG_SQUASHFS_LZ4
+static const struct squashfs_decompressor squashfs_lz4_comp_ops = {
+	NULL, NULL, NULL, LZ4_COMPRESSION, "lz4", 0
+};
+#endif
+
 static const struct squashfs_decompressor squashfs_unknown_comp_ops = {
 	NULL, NULL, NULL, 0, "unknown", 0
 };
@@ -59,6 +67,7 @@ static const struct squashfs_decompressor *decompressor[] = {
 	&squashfs_zlib_comp_ops,
 	&squashfs_lzo_comp_ops,
 	&squashfs_xz_comp_ops,
+	&squashfs_lz4_comp_ops,
 	&squashfs_lzma_unsupported_comp_ops,
 	&squashfs_unknown_comp_ops
 };
@@ -74,3 +83,80 @@ const struct squashfs_decompressor *squashfs_lookup_decompressor(int id)
 
 	return decompressor[i];
 }
+
+
+/*
+ * Allocates the decompressor streams: one shared by all readers, or if
+ * @percpu is set one per possible CPU, so that readers on different CPUs
+ * decompress in parallel.
+ */
+int squashfs_decompressor_setup(struct squashfs_sb_info *msblk, int percpu)
+{
+	int i, nr = percpu ? nr_cpu_ids : 1;
+
+	msblk->stream = kcalloc(nr, sizeof(*msblk->stream), GFP_KERNEL);
+	if (msblk->stream == NULL)
+		return -ENOMEM;
+	msblk->percpu_stream = percpu;
+
+	for (i = 0; i < nr; i++) {
+		if (percpu && !cpu_possible(i))
+			continue;
+
+		mutex_init(&msblk->stream[i].mutex);
+		msblk->stream[i].stream = msblk->decompressor->init(msblk);
+		if (msblk->stream[i].stream == NULL) {
+			squashfs_decompressor_destroy(msblk);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+
+void squashfs_decompressor_destroy(struct squashfs_sb_info *msblk)
+{
+	int i, nr = msblk->percpu_stream ? nr_cpu_ids : 1;
+
+	if (msblk->stream == NULL)
+		return;
+
+	for (i = 0; i < nr; i++)
+		if (msblk->stream[i].stream)
+			msblk->decompressor->free(msblk->stream[i].stream);
+
+	kfree(msblk->stream);
+	msblk->stream = NULL;
+}
+
+
+/* How many readers can usefully decompress at the same time */
+int squashfs_max_decompressors(struct squashfs_sb_info *msblk)
+{
+	return msblk->percpu_stream ? num_online_cpus() : 1;
+}
+
+
+/*
+ * Decompresses with the stream of the CPU we are running on.  We may
+ * sleep and migrate while holding it, in which case another reader can
+ * briefly wait for it, but no stream is ever used concurrently.
+ */
+int squashfs_decompress(struct squashfs_sb_info *msblk, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length, int srclength,
+	int pages)
+{
+	struct squashfs_stream *stream = msblk->stream;
+	int res;
+
+	if (msblk->percpu_stream)
+		stream += raw_smp_processor_id();
+
+	mutex_lock(&stream->mutex);
+	res = msblk->decompressor->decompress(msblk, stream->stream, buffer,
+		bh, b, offset, length, srclength, pages);
+	mutex_unlock(&stream->mutex);
+
+	return res;
+}
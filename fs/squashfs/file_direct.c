@@ -0,0 +1,145 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2002, 2003, 2004, 2005, 2006, 2007, 2008
+ * Phillip Lougher <phillip@lougher.demon.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * file_direct.c
+ */
+
+/*
+ * Datablocks are decompressed straight into the page cache pages they
+ * cover, rather than into a read_page cache entry that is then copied.
+ *
+ * The decompressors write to kernel addresses, so only lowmem pages can
+ * be used directly.  Positions whose page is in highmem, or which could
+ * not be grabbed because another reader holds the page locked or it is
+ * already uptodate, get a temporary page instead; highmem pages are then
+ * filled from it, the others discarded.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "squashfs.h"
+
+/* Read separately compressed datablock directly into page cache */
+int squashfs_readpage_block(struct page *target_page, u64 block, int bsize)
+{
+	struct inode *inode = target_page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int file_end = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target_page->index & ~mask;
+	int end_index = start_index | mask;
+	int i, n, pages, avail, res = -ENOMEM;
+	struct page **page, **tmp;
+	void **buffer;
+	void *pageaddr;
+
+	if (end_index > file_end)
+		end_index = file_end;
+	pages = end_index - start_index + 1;
+
+	/* page cache pages, temporary pages and buffers, in one allocation */
+	page = kcalloc(pages * 3, sizeof(void *), GFP_KERNEL);
+	if (page == NULL)
+		goto error;
+	tmp = page + pages;
+	buffer = (void **) (tmp + pages);
+
+	/* Try to grab all the pages covered by the Squashfs block */
+	for (i = 0, n = start_index; i < pages; i++, n++) {
+		page[i] = (n == target_page->index) ? target_page :
+			grab_cache_page_nowait(target_page->mapping, n);
+
+		if (page[i] && page[i] != target_page &&
+						PageUptodate(page[i])) {
+			unlock_page(page[i]);
+			page_cache_release(page[i]);
+			page[i] = NULL;
+		}
+
+		if (page[i] && !PageHighMem(page[i])) {
+			buffer[i] = page_address(page[i]);
+			continue;
+		}
+
+		tmp[i] = alloc_page(GFP_KERNEL);
+		if (tmp[i] == NULL)
+			goto release;
+		buffer[i] = page_address(tmp[i]);
+	}
+
+	res = squashfs_read_data(inode->i_sb, buffer, block, bsize, NULL,
+		pages << PAGE_CACHE_SHIFT, pages);
+	if (res < 0) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+		goto release;
+	}
+
+	for (i = 0; i < pages; i++) {
+		/* Zero whatever the block did not fill */
+		avail = clamp_t(int, res - (i << PAGE_CACHE_SHIFT), 0,
+			PAGE_CACHE_SIZE);
+		memset(buffer[i] + avail, 0, PAGE_CACHE_SIZE - avail);
+
+		if (page[i] == NULL)
+			continue;
+
+		if (tmp[i]) {
+			pageaddr = kmap_atomic(page[i], KM_USER0);
+			memcpy(pageaddr, buffer[i], PAGE_CACHE_SIZE);
+			kunmap_atomic(pageaddr, KM_USER0);
+		}
+
+		flush_dcache_page(page[i]);
+		SetPageUptodate(page[i]);
+		unlock_page(page[i]);
+		if (page[i] != target_page)
+			page_cache_release(page[i]);
+	}
+
+	res = 0;
+	goto out;
+
+release:
+	/* The target page is left to the caller */
+	for (i = 0; i < pages; i++) {
+		if (page[i] && page[i] != target_page) {
+			unlock_page(page[i]);
+			page_cache_release(page[i]);
+		}
+	}
+
+out:
+	for (i = 0; i < pages; i++)
+		if (tmp[i])
+			__free_page(tmp[i]);
+	kfree(page);
+error:
+	return res;
+}
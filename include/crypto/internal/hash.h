@@ -101,6 +101,8 @@ struct shash_alg *shash_attr_alg(struct rtattr *rta, u32 type, u32 mask);
 int shash_ahash_update(struct ahash_request *req, struct shash_desc *desc);
 int shash_ahash_finup(struct ahash_request *req, struct shash_desc *desc);
 int shash_ahash_digest(struct ahash_request *req, struct shash_desc *desc);
+int shash_finup_mb_serial(struct shash_desc *desc, const u8 * const data[],
+			  unsigned int len, u8 * const outs[], unsigned int num);
 
 int crypto_init_shash_ops_async(struct crypto_tfm *tfm);
 
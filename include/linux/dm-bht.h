@@ -13,6 +13,8 @@
 #include <linux/crypto.h>
 #include <linux/types.h>
 
+struct bio_vec;
+
 /* To avoid allocating memory for digest tests, we just setup a
  * max to use for now.
  */
@@ -121,6 +123,8 @@ int dm_bht_populate(struct dm_bht *bht, void *read_cb_ctx,
 		    unsigned int block);
 int dm_bht_verify_block(struct dm_bht *bht, unsigned int block,
 			struct page *pg, unsigned int offset);
+int dm_bht_verify_range(struct dm_bht *bht, unsigned int block,
+			struct bio_vec *bvec, unsigned int count);
 
 /* Functions for creating struct dm_bhts on disk.  A newly created dm_bht
  * should not be directly used for verification. (It should be repopulated.)
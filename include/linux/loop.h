@@ -27,6 +27,7 @@ enum {
 };
 
 struct loop_func_table;
+struct loop_dio_map;
 
 struct loop_device {
 	int		lo_number;
@@ -65,6 +66,11 @@ struct loop_device {
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
 	struct list_head	lo_list;
+
+	/* direct I/O to the backing device, see loop_set_dio() */
+	struct loop_dio_map	*lo_dio;	/* only touched by lo_thread */
+	atomic_t		lo_dio_inflight;
+	wait_queue_head_t	lo_dio_wait;
 };
 
 #endif /* __KERNEL__ */
@@ -76,6 +82,7 @@ enum {
 	LO_FLAGS_READ_ONLY	= 1,
 	LO_FLAGS_USE_AOPS	= 2,
 	LO_FLAGS_AUTOCLEAR	= 4,
+	LO_FLAGS_DIRECT_IO	= 16,
 };
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
@@ -160,5 +167,11 @@ int loop_unregister_transfer(int number);
 #define LOOP_GET_STATUS64	0x4C05
 #define LOOP_CHANGE_FD		0x4C06
 #define LOOP_SET_CAPACITY	0x4C07
+/*
+ * Non-zero remaps IO straight to the blocks of the backing file.  Needs
+ * a block device, or a fully written file on ext2, ext3, ext4 or XFS
+ * that is neither data journaled nor an XFS realtime file.
+ */
+#define LOOP_SET_DIRECT_IO	0x4C08
 
 #endif
@@ -0,0 +1,53 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  Compresses to and decompresses from the LZ4 block format: a sequence
+ *  of (literal run, back-reference) pairs with 16-bit offsets, ending in
+ *  a literal run.  Compression speed is close to LZO's, decompression is
+ *  considerably faster.
+ *
+ *  The format is described at http://code.google.com/p/lz4/
+ */
+
+#define LZ4_HASH_LOG		12
+#define LZ4_MEM_COMPRESS	((1 << LZ4_HASH_LOG) * sizeof(u32))
+
+/* Largest output lz4_compress() may produce for @isize bytes of input */
+#define lz4_compressbound(isize) ((isize) + ((isize) / 255) + 16)
+
+/*
+ * Compresses @src_len bytes from @src into @dst, which must have room for
+ * lz4_compressbound(@src_len) bytes, and stores the compressed length in
+ * @dst_len.  This requires 'wrkmem' of size LZ4_MEM_COMPRESS.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/*
+ * Decompresses a block that is known to expand to exactly @dst_len bytes.
+ * On entry @src_len is the number of bytes available at @src, on return
+ * the number actually consumed; anything after the block is ignored.
+ */
+int lz4_decompress(const unsigned char *src, size_t *src_len,
+		unsigned char *dst, size_t dst_len);
+
+/*
+ * Decompresses the whole of @src_len bytes at @src into @dst, which has
+ * room for *@dst_len bytes.  The decompressed length is returned in
+ * @dst_len.
+ */
+int lz4_decompress_unknownoutputsize(const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t *dst_len);
+
+/*
+ * Return values (< 0 = Error)
+ */
+#define LZ4_E_OK		0
+#define LZ4_E_ERROR		(-1)
+#define LZ4_E_INPUT_OVERRUN	(-4)
+#define LZ4_E_OUTPUT_OVERRUN	(-5)
+#define LZ4_E_LOOKBEHIND_OVERRUN (-6)
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  A greedy single-pass compressor producing the LZ4 block format.  Match
+ *  candidates come from a hash table of the last position each 4-byte
+ *  sequence was seen at.
+ *
+ *  The format is described at http://code.google.com/p/lz4/
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(const unsigned char *p)
+{
+	return (get_unaligned((const u32 *)p) * 2654435761U) >>
+		(32 - LZ4_HASH_LOG);
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+static inline unsigned char *lz4_put_literals(unsigned char *op,
+		const unsigned char *anchor, size_t len, unsigned char **token)
+{
+	*token = op++;
+	if (len >= RUN_MASK) {
+		**token = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, len - RUN_MASK);
+	} else
+		**token = len << ML_BITS;
+
+	memcpy(op, anchor, len);
+	return op + len;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	const unsigned char *ip = src, *anchor = src, *ref;
+	unsigned char *op = dst, *token;
+	u32 *table = wrkmem;
+	size_t len;
+	u32 h;
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+
+	while (ip < mflimit) {
+		h = lz4_hash(ip);
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref == ip || ip - ref > MAX_DISTANCE ||
+		    get_unaligned((const u32 *)ref) !=
+		    get_unaligned((const u32 *)ip)) {
+			ip++;
+			continue;
+		}
+
+		/* the match may extend back into the pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		op = lz4_put_literals(op, anchor, ip - anchor, &token);
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		anchor = ip;
+		ip += MINMATCH;
+		ref += MINMATCH;
+		while (ip <= matchlimit - sizeof(unsigned long) &&
+		       get_unaligned((const unsigned long *)ip) ==
+		       get_unaligned((const unsigned long *)ref)) {
+			ip += sizeof(unsigned long);
+			ref += sizeof(unsigned long);
+		}
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		len = ip - anchor - MINMATCH;
+		if (len >= ML_MASK) {
+			*token += ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else
+			*token += len;
+
+		anchor = ip;
+
+		/* remember a position inside the match, it helps runs */
+		if (ip < mflimit) {
+			h = lz4_hash(ip - 2);
+			table[h] = ip - 2 - src;
+		}
+	}
+
+last_literals:
+	op = lz4_put_literals(op, anchor, iend - anchor, &token);
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
@@ -0,0 +1,124 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Every length and offset read from the input is checked against both
+ *  buffers, so corrupt input fails rather than overrunning memory.
+ *
+ *  The format is described at http://code.google.com/p/lz4/
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/*
+ * Reads the continuation bytes of a run or match length.
+ */
+static inline int lz4_get_length(const unsigned char **ipp,
+		const unsigned char *iend, size_t *len)
+{
+	const unsigned char *ip = *ipp;
+	unsigned char s;
+
+	do {
+		if (unlikely(ip >= iend))
+			return LZ4_E_INPUT_OVERRUN;
+		s = *ip++;
+		*len += s;
+	} while (s == 255);
+
+	*ipp = ip;
+	return LZ4_E_OK;
+}
+
+/*
+ * With @exact the output must fill @dst_len exactly, and decoding stops
+ * as soon as it has; otherwise the input must be consumed exactly.
+ */
+static int lz4_uncompress(const unsigned char *src, size_t *src_len,
+		unsigned char *dst, size_t *dst_len, bool exact)
+{
+	const unsigned char *ip = src;
+	const unsigned char * const iend = src + *src_len;
+	unsigned char *op = dst;
+	unsigned char * const oend = dst + *dst_len;
+	const unsigned char *ref;
+	unsigned int token;
+	size_t len, offset;
+	int ret;
+
+	for (;;) {
+		if (unlikely(ip >= iend))
+			return LZ4_E_INPUT_OVERRUN;
+		token = *ip++;
+
+		len = token >> ML_BITS;
+		if (len == RUN_MASK) {
+			ret = lz4_get_length(&ip, iend, &len);
+			if (unlikely(ret))
+				return ret;
+		}
+		if (unlikely(len > iend - ip))
+			return LZ4_E_INPUT_OVERRUN;
+		if (unlikely(len > oend - op))
+			return LZ4_E_OUTPUT_OVERRUN;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* the block ends with a literal run */
+		if (exact ? op == oend : ip == iend)
+			break;
+
+		if (unlikely(iend - ip < 2))
+			return LZ4_E_INPUT_OVERRUN;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!offset || offset > op - dst))
+			return LZ4_E_LOOKBEHIND_OVERRUN;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK) {
+			ret = lz4_get_length(&ip, iend, &len);
+			if (unlikely(ret))
+				return ret;
+		}
+		len += MINMATCH;
+		if (unlikely(len > oend - op))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		ref = op - offset;
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* overlapping copy repeats the last @offset bytes */
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*src_len = ip - src;
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+
+int lz4_decompress(const unsigned char *src, size_t *src_len,
+		unsigned char *dst, size_t dst_len)
+{
+	return lz4_uncompress(src, src_len, dst, &dst_len, true);
+}
+EXPORT_SYMBOL_GPL(lz4_decompress);
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t *dst_len)
+{
+	return lz4_uncompress(src, &src_len, dst, dst_len, false);
+}
+EXPORT_SYMBOL_GPL(lz4_decompress_unknownoutputsize);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
@@ -0,0 +1,22 @@
+/*
+ *  lz4defs.h -- constants of the LZ4 block format
+ *
+ *  The format is described at http://code.google.com/p/lz4/
+ */
+
+/* every match is at least this long */
+#define MINMATCH	4
+
+/* the last sequence is literals only, at least this many of them */
+#define LASTLITERALS	5
+
+/* no match may start within this many bytes of the end of the input */
+#define MFLIMIT		(8 + MINMATCH)
+
+#define MAX_DISTANCE	((1 << 16) - 1)
+
+/* token: literal run length in the high nibble, match length in the low */
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)